@@ -0,0 +1,38 @@
+#pragma once
+
+#include "HaloBluetooth.h"
+#include "Metrics.h"
+#include <QBluetoothDeviceInfo>
+#include <QHash>
+
+// Hands each advert from the shared scan to the location its device belongs
+// to. Adverts are counted here once, however many locations there are, and
+// almost all of them are from something that isn't ours and stop at the
+// hash lookup.
+class AdvertRouter
+{
+public:
+    void addDevices(const QList<QBluetoothUuid>& uuids, HaloBluetooth* bluetooth);
+    void route(const QBluetoothDeviceInfo& info) const;
+
+private:
+    QHash<QBluetoothUuid, HaloBluetooth*> mBluetooths;
+};
+
+inline void AdvertRouter::addDevices(const QList<QBluetoothUuid>& uuids, HaloBluetooth* bluetooth)
+{
+    for (const auto& uuid : uuids) {
+        mBluetooths.insert(uuid, bluetooth);
+    }
+}
+
+inline void AdvertRouter::route(const QBluetoothDeviceInfo& info) const
+{
+    metrics::increment(metrics::Counter::AdvertsSeen);
+    const auto bluetooth = mBluetooths.value(deviceId(info));
+    if (bluetooth == nullptr) {
+        metrics::increment(metrics::Counter::AdvertsFiltered);
+        return;
+    }
+    bluetooth->deviceDiscovered(info);
+}
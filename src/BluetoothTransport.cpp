@@ -0,0 +1,109 @@
+#include "BluetoothTransport.h"
+#include "Metrics.h"
+#include <QDebug>
+#include <QTimer>
+#include <algorithm>
+
+BluetoothLink::BluetoothLink(const QBluetoothDeviceInfo& info, QObject* parent)
+    : QObject(parent), mInfo(info)
+{
+}
+
+BluetoothLink::~BluetoothLink()
+{
+}
+
+void BluetoothLink::connectTimedOut()
+{
+    qDebug() << "connect timed out for" << deviceId(mInfo);
+    emit errorOccurred(QLowEnergyController::ConnectionError);
+}
+
+BluetoothTransport::BluetoothTransport(uint32_t maxConnects, uint32_t connectTimeout, QObject* parent)
+    : QObject(parent), mMaxConnects(maxConnects), mConnectTimeout(static_cast<int>(connectTimeout) * 1000)
+{
+    metrics::addCollector(this, [this](metrics::Writer& writer) {
+        auto adapters = mSchedulers.keys();
+        std::sort(adapters.begin(), adapters.end());
+        writer.describe("halo_connects_active", "gauge", "ble connects pending on the adapter");
+        for (const auto adapter : adapters) {
+            writer.sample("halo_connects_active").label("adapter", adapterLabel(adapter)).value(static_cast<uint64_t>(mSchedulers.constFind(adapter)->active()));
+        }
+        writer.describe("halo_connects_queued", "gauge", "ble connects waiting for a free slot on the adapter");
+        for (const auto adapter : adapters) {
+            writer.sample("halo_connects_queued").label("adapter", adapterLabel(adapter)).value(static_cast<uint64_t>(mSchedulers.constFind(adapter)->queued()));
+        }
+    });
+}
+
+BluetoothTransport::~BluetoothTransport()
+{
+    metrics::removeCollector(this);
+}
+
+QByteArray BluetoothTransport::adapterLabel(int adapter) const
+{
+    return QByteArray::number(adapter);
+}
+
+ConnectionScheduler& BluetoothTransport::scheduler(int adapter)
+{
+    auto it = mSchedulers.find(adapter);
+    if (it == mSchedulers.end()) {
+        it = mSchedulers.insert(adapter, ConnectionScheduler(mMaxConnects));
+    }
+    return it.value();
+}
+
+void BluetoothTransport::requestConnect(BluetoothLink* link, int priority)
+{
+    if (!mConnectLinks.contains(link)) {
+        mConnectLinks.insert(link, link->adapter());
+        QObject::connect(link, &BluetoothLink::connected, this, [this, link]() {
+            connectFinished(link);
+        });
+        QObject::connect(link, &BluetoothLink::errorOccurred, this, [this, link]() {
+            connectFinished(link);
+        });
+        QObject::connect(link, &BluetoothLink::disconnected, this, [this, link]() {
+            connectFinished(link);
+        });
+        // only the pointer is left by now
+        QObject::connect(link, &QObject::destroyed, this, [this, link]() {
+            connectFinished(link);
+            mConnectLinks.remove(link);
+        });
+    }
+    scheduler(link->adapter()).request(link, priority);
+    startConnects();
+}
+
+void BluetoothTransport::connectFinished(const BluetoothLink* link)
+{
+    const auto adapter = mConnectLinks.value(link, -1);
+    if (adapter < 0) {
+        return;
+    }
+    scheduler(adapter).finished(link);
+    startConnects();
+}
+
+void BluetoothTransport::startConnects()
+{
+    for (auto it = mSchedulers.begin(), end = mSchedulers.end(); it != end; ++it) {
+        while (auto link = it->takeNext()) {
+            if (mConnectTimeout > 0) {
+                // dies with the link, a released link can't time out
+                QTimer::singleShot(mConnectTimeout, link, [this, link]() {
+                    const auto adapter = mConnectLinks.value(link, -1);
+                    if (adapter >= 0 && scheduler(adapter).isActive(link)) {
+                        link->connectTimedOut();
+                    }
+                });
+            }
+            link->connectToDevice();
+        }
+    }
+}
+
+#include "moc_BluetoothTransport.cpp"
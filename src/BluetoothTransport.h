@@ -0,0 +1,147 @@
+#pragma once
+
+#include "ConnectionScheduler.h"
+#include <QObject>
+#include <QBluetoothAddress>
+#include <QBluetoothDeviceInfo>
+#include <QBluetoothUuid>
+#include <QByteArray>
+#include <QHash>
+#include <QLowEnergyConnectionParameters>
+#include <QLowEnergyController>
+#include <QLowEnergyService>
+#include <cstdint>
+
+// The key of a device everywhere in halo-qt. CoreBluetooth hides addresses
+// and identifies peripherals by uuid, BlueZ and Windows have no uuid, only
+// the address, which is folded into a uuid here so both look the same
+QBluetoothUuid deviceId(const QBluetoothDeviceInfo& info);
+QBluetoothUuid deviceId(const QBluetoothAddress& address);
+
+// A connection to one Avi-on device. Created by a BluetoothTransport and
+// owned by whoever asked for it.
+class BluetoothLink : public QObject
+{
+    Q_OBJECT
+public:
+    enum class Characteristic { Low, High };
+
+    BluetoothLink(const QBluetoothDeviceInfo& info, QObject* parent = nullptr);
+    ~BluetoothLink() override;
+
+    const QBluetoothDeviceInfo& info() const;
+    // index of the local adapter the link goes through, see --adapters
+    int adapter() const;
+    void setAdapter(int adapter);
+
+    virtual void connectToDevice() = 0;
+    // resolves the Avi-on service and its low and high characteristics, emits ready()
+    virtual void discoverServices() = 0;
+    virtual void write(Characteristic characteristic, const QByteArray& data) = 0;
+    // whether written() or writeFailed() follows every write of the high
+    // characteristic, only known once ready
+    virtual bool confirmsWrites() const = 0;
+    // the negotiated att mtu, -1 if unknown
+    virtual int mtu() const = 0;
+    // asks the device for a new connection interval, latency and timeout,
+    // connectionUpdated() reports what was agreed
+    virtual void requestConnectionUpdate(const QLowEnergyConnectionParameters& parameters) = 0;
+    // gives up on a connect that never completed, reported like any failed one
+    void connectTimedOut();
+
+signals:
+    void connected();
+    void disconnected();
+    void errorOccurred(QLowEnergyController::Error error);
+    void serviceErrorOccurred(QLowEnergyService::ServiceError error);
+    void ready();
+    // a whole packet, i.e. the high characteristic, was acknowledged by the
+    // device. Only emitted when confirmsWrites()
+    void written();
+    void writeFailed();
+    // a mesh packet seen by the device, still encrypted
+    void packetReceived(const QByteArray& packet);
+    void connectionUpdated(const QLowEnergyConnectionParameters& parameters);
+
+private:
+    QBluetoothDeviceInfo mInfo;
+    int mAdapter = 0;
+};
+
+inline QBluetoothUuid deviceId(const QBluetoothDeviceInfo& info)
+{
+    if (!info.deviceUuid().isNull()) {
+        return info.deviceUuid();
+    }
+    return deviceId(info.address());
+}
+
+inline QBluetoothUuid deviceId(const QBluetoothAddress& address)
+{
+    // "HALO" then the 48 bit address in the last six bytes
+    const auto a = address.toUInt64();
+    return QBluetoothUuid(QUuid(0x48414c4f, 0, 0, 0, 0,
+                                static_cast<uchar>(a >> 40), static_cast<uchar>(a >> 32), static_cast<uchar>(a >> 24),
+                                static_cast<uchar>(a >> 16), static_cast<uchar>(a >> 8), static_cast<uchar>(a)));
+}
+
+inline const QBluetoothDeviceInfo& BluetoothLink::info() const
+{
+    return mInfo;
+}
+
+inline int BluetoothLink::adapter() const
+{
+    return mAdapter;
+}
+
+inline void BluetoothLink::setAdapter(int adapter)
+{
+    mAdapter = adapter;
+}
+
+// Discovery and link creation, implemented on top of Qt Bluetooth and by an
+// in-process simulated mesh. Connects are scheduled here for every location
+// at once, see --max-connects
+class BluetoothTransport : public QObject
+{
+    Q_OBJECT
+public:
+    enum class Error { PermissionError };
+
+    // connectTimeout is in seconds, 0 waits for as long as the stack does
+    BluetoothTransport(uint32_t maxConnects, uint32_t connectTimeout, QObject* parent = nullptr);
+    ~BluetoothTransport() override;
+
+    // emits ready() or error()
+    virtual void initialize() = 0;
+    virtual void startDiscovery() = 0;
+    virtual void rediscover() = 0;
+    virtual BluetoothLink* createLink(const QBluetoothDeviceInfo& info, QObject* parent) = 0;
+
+    // calls connectToDevice() on the link once its adapter has a free connect
+    // slot. The slot is freed when the link connects, fails or is destroyed,
+    // a connect still pending after the timeout fails the link
+    void requestConnect(BluetoothLink* link, int priority);
+
+protected:
+    // the adapter's name in metrics
+    virtual QByteArray adapterLabel(int adapter) const;
+
+signals:
+    void ready();
+    void error(Error error);
+    void deviceDiscovered(const QBluetoothDeviceInfo& info);
+
+private:
+    ConnectionScheduler& scheduler(int adapter);
+    void connectFinished(const BluetoothLink* link);
+    void startConnects();
+
+    uint32_t mMaxConnects;
+    int mConnectTimeout;
+    // by adapter index, see BluetoothLink::adapter()
+    QHash<int, ConnectionScheduler> mSchedulers;
+    // links with a requested connect and their adapter
+    QHash<const BluetoothLink*, int> mConnectLinks;
+};
@@ -0,0 +1,278 @@
+#include "CommandParser.h"
+#include <limits>
+
+namespace commands {
+
+static bool parseId(const QString& topic, qsizetype& pos, qsizetype end, uint32_t* id)
+{
+    uint64_t value = 0;
+    const auto start = pos;
+    for (; pos < end; ++pos) {
+        const auto c = topic.at(pos).unicode();
+        if (c < '0' || c > '9') {
+            break;
+        }
+        value = value * 10 + (c - '0');
+        if (value > std::numeric_limits<uint32_t>::max()) {
+            return false;
+        }
+    }
+    *id = static_cast<uint32_t>(value);
+    return pos > start;
+}
+
+bool parseTopic(const QString& topic, QByteArrayView prefix, Target* target)
+{
+    const auto end = topic.size();
+    if (end < prefix.size()) {
+        return false;
+    }
+    for (qsizetype i = 0; i < prefix.size(); ++i) {
+        if (topic.at(i).unicode() != static_cast<char16_t>(prefix[i])) {
+            return false;
+        }
+    }
+    qsizetype pos = prefix.size();
+    if (!parseId(topic, pos, end, &target->locationId) || pos == end || topic.at(pos).unicode() != '_') {
+        return false;
+    }
+    ++pos;
+    target->isGroup = pos < end && topic.at(pos).unicode() == 'g';
+    if (target->isGroup) {
+        ++pos;
+    }
+    return parseId(topic, pos, end, &target->id) && pos == end;
+}
+
+namespace {
+
+// a cursor over the payload, every read either consumes a whole token or
+// fails and leaves the payload rejected
+class Reader
+{
+public:
+    Reader(QByteArrayView json);
+
+    bool atEnd();
+    bool consume(char c);
+    bool peek(char c);
+    bool peekNumber();
+    // the raw contents between the quotes
+    bool string(QByteArrayView* value);
+    bool number(double* value);
+    bool skipValue(int depth = 0);
+
+private:
+    void skipSpace();
+    bool literal(QByteArrayView word);
+
+    // deeper nesting than any command has is treated as garbage
+    enum { MaxDepth = 16 };
+
+    const char* mPos;
+    const char* mEnd;
+};
+
+Reader::Reader(QByteArrayView json)
+    : mPos(json.data()), mEnd(json.data() + json.size())
+{
+}
+
+void Reader::skipSpace()
+{
+    while (mPos < mEnd && (*mPos == ' ' || *mPos == '\t' || *mPos == '\n' || *mPos == '\r')) {
+        ++mPos;
+    }
+}
+
+bool Reader::atEnd()
+{
+    skipSpace();
+    return mPos == mEnd;
+}
+
+bool Reader::peek(char c)
+{
+    skipSpace();
+    return mPos < mEnd && *mPos == c;
+}
+
+bool Reader::peekNumber()
+{
+    skipSpace();
+    return mPos < mEnd && ((*mPos >= '0' && *mPos <= '9') || *mPos == '-');
+}
+
+bool Reader::consume(char c)
+{
+    if (!peek(c)) {
+        return false;
+    }
+    ++mPos;
+    return true;
+}
+
+bool Reader::string(QByteArrayView* value)
+{
+    if (!consume('"')) {
+        return false;
+    }
+    const auto start = mPos;
+    while (mPos < mEnd) {
+        const auto c = static_cast<unsigned char>(*mPos);
+        if (c == '"') {
+            *value = QByteArrayView(start, mPos);
+            ++mPos;
+            return true;
+        } else if (c < 0x20) {
+            return false;
+        } else if (c == '\\') {
+            if (++mPos == mEnd) {
+                return false;
+            }
+        }
+        ++mPos;
+    }
+    return false;
+}
+
+bool Reader::number(double* value)
+{
+    skipSpace();
+    const auto start = mPos;
+    while (mPos < mEnd && ((*mPos >= '0' && *mPos <= '9') || *mPos == '-' || *mPos == '+' || *mPos == '.' || *mPos == 'e' || *mPos == 'E')) {
+        ++mPos;
+    }
+    if (mPos == start) {
+        return false;
+    }
+    bool ok;
+    *value = QByteArrayView(start, mPos).toDouble(&ok);
+    return ok;
+}
+
+bool Reader::literal(QByteArrayView word)
+{
+    if (mEnd - mPos < word.size() || QByteArrayView(mPos, word.size()) != word) {
+        return false;
+    }
+    mPos += word.size();
+    return true;
+}
+
+bool Reader::skipValue(int depth)
+{
+    if (depth > MaxDepth) {
+        return false;
+    }
+    skipSpace();
+    if (mPos == mEnd) {
+        return false;
+    }
+    QByteArrayView text;
+    double number;
+    switch (*mPos) {
+    case '"':
+        return string(&text);
+    case '{':
+        ++mPos;
+        if (consume('}')) {
+            return true;
+        }
+        do {
+            if (!string(&text) || !consume(':') || !skipValue(depth + 1)) {
+                return false;
+            }
+        } while (consume(','));
+        return consume('}');
+    case '[':
+        ++mPos;
+        if (consume(']')) {
+            return true;
+        }
+        do {
+            if (!skipValue(depth + 1)) {
+                return false;
+            }
+        } while (consume(','));
+        return consume(']');
+    case 't':
+        return literal("true");
+    case 'f':
+        return literal("false");
+    case 'n':
+        return literal("null");
+    default:
+        return this->number(&number);
+    }
+}
+
+}
+
+bool parsePayload(QByteArrayView payload, Command* command)
+{
+    Reader reader(payload);
+    if (!reader.consume('{')) {
+        return false;
+    }
+    *command = {};
+    if (reader.consume('}')) {
+        return reader.atEnd();
+    }
+    do {
+        QByteArrayView key;
+        if (!reader.string(&key) || !reader.consume(':')) {
+            return false;
+        }
+        // the wrong type reads as off, 0 or not set, like before
+        QByteArrayView text;
+        double number;
+        if (key == "state") {
+            if (reader.peek('"')) {
+                if (!reader.string(&text)) {
+                    return false;
+                }
+                command->state = text == "ON";
+            } else {
+                if (!reader.skipValue()) {
+                    return false;
+                }
+                command->state = false;
+            }
+        } else if (key == "brightness") {
+            if (!reader.peekNumber()) {
+                if (!reader.skipValue()) {
+                    return false;
+                }
+                command->brightness = 0;
+            } else {
+                if (!reader.number(&number)) {
+                    return false;
+                }
+                // fractions and anything out of int range read as 0
+                const bool integral = number >= std::numeric_limits<int>::min() && number <= std::numeric_limits<int>::max()
+                    && number == static_cast<double>(static_cast<int>(number));
+                command->brightness = static_cast<uint8_t>(integral ? static_cast<int>(number) : 0);
+            }
+        } else if (key == "color_temp") {
+            if (!reader.peekNumber()) {
+                if (!reader.skipValue()) {
+                    return false;
+                }
+            } else {
+                if (!reader.number(&number)) {
+                    return false;
+                }
+                // mireds that don't make a kelvin value are dropped
+                if (number >= 1. && number <= 1000000.) {
+                    command->temperature = static_cast<uint32_t>(1000000. / number);
+                }
+            }
+        } else if (!reader.skipValue()) {
+            return false;
+        }
+    } while (reader.consume(','));
+    return reader.consume('}') && reader.atEnd();
+}
+
+}
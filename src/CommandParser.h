@@ -0,0 +1,37 @@
+#pragma once
+
+#include <QByteArrayView>
+#include <QString>
+#include <cstdint>
+#include <optional>
+
+// Reads home assistant json schema light commands straight from the mqtt
+// topic and payload, without building a document or copying anything.
+namespace commands {
+
+// the entity a command topic is for, <prefix><location>_<device> or
+// <prefix><location>_g<group>
+struct Target
+{
+    uint32_t locationId = 0;
+    uint32_t id = 0;
+    bool isGroup = false;
+};
+
+// the fields of a command that were present
+struct Command
+{
+    std::optional<bool> state;
+    std::optional<uint8_t> brightness;
+    // in kelvin, the command carries mireds
+    std::optional<uint32_t> temperature;
+};
+
+// false if the topic doesn't start with prefix or the ids don't parse
+bool parseTopic(const QString& topic, QByteArrayView prefix, Target* target);
+
+// false for anything that isn't a single well formed json object. Unknown
+// keys are skipped, escapes in keys and in the state are not decoded.
+bool parsePayload(QByteArrayView payload, Command* command);
+
+}
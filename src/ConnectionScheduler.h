@@ -0,0 +1,100 @@
+#pragma once
+
+#include <QList>
+#include <algorithm>
+#include <cstdint>
+
+class BluetoothLink;
+
+// Hands out BLE connects one at a time so no more than a fixed number are
+// pending on an adapter at once. Waiting devices are taken by priority and
+// then in the order they were requested. A limit of 0 means no limit.
+class ConnectionScheduler
+{
+public:
+    ConnectionScheduler(uint32_t maxConnects);
+
+    void request(BluetoothLink* link, int priority);
+    // the next link to connect, null when at the limit or none is waiting
+    BluetoothLink* takeNext();
+    // the connect succeeded, failed or was abandoned
+    void finished(const BluetoothLink* link);
+
+    qsizetype queued() const;
+    qsizetype active() const;
+    // whether the link's connect is under way
+    bool isActive(const BluetoothLink* link) const;
+
+private:
+    struct Request
+    {
+        BluetoothLink* link;
+        int priority;
+        uint64_t order;
+    };
+
+    uint32_t mMaxConnects;
+    uint64_t mOrder = 0;
+    QList<Request> mQueue;
+    QList<const BluetoothLink*> mActive;
+};
+
+inline ConnectionScheduler::ConnectionScheduler(uint32_t maxConnects)
+    : mMaxConnects(maxConnects)
+{
+}
+
+inline void ConnectionScheduler::request(BluetoothLink* link, int priority)
+{
+    if (mActive.contains(link)) {
+        return;
+    }
+    for (auto& req : mQueue) {
+        if (req.link == link) {
+            req.priority = std::max(req.priority, priority);
+            return;
+        }
+    }
+    mQueue.append({ link, priority, mOrder++ });
+}
+
+inline BluetoothLink* ConnectionScheduler::takeNext()
+{
+    if (mQueue.isEmpty() || (mMaxConnects > 0 && static_cast<uint32_t>(mActive.size()) >= mMaxConnects)) {
+        return nullptr;
+    }
+    qsizetype best = 0;
+    for (qsizetype i = 1; i < mQueue.size(); ++i) {
+        const auto& req = mQueue[i];
+        if (req.priority > mQueue[best].priority || (req.priority == mQueue[best].priority && req.order < mQueue[best].order)) {
+            best = i;
+        }
+    }
+    const auto link = mQueue[best].link;
+    mQueue.removeAt(best);
+    mActive.append(link);
+    return link;
+}
+
+inline void ConnectionScheduler::finished(const BluetoothLink* link)
+{
+    mActive.removeOne(link);
+    mQueue.removeIf([link](const auto& req) {
+        return req.link == link;
+    });
+}
+
+inline qsizetype ConnectionScheduler::queued() const
+{
+    return mQueue.size();
+}
+
+inline qsizetype ConnectionScheduler::active() const
+{
+    return mActive.size();
+}
+
+inline bool ConnectionScheduler::isActive(const BluetoothLink* link) const
+{
+    return mActive.contains(link);
+}
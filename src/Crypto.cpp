@@ -2,6 +2,8 @@
 #include "qaesencryption.h"
 #include <QCryptographicHash>
 #include <QMessageAuthenticationCode>
+#include <algorithm>
+#include <cstring>
 
 namespace crypto {
 
@@ -41,4 +43,373 @@ QByteArray makePacket(const QByteArray& key, int32_t seq, const QByteArray& data
     return out;
 }
 
+static const uint8_t sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+static inline uint8_t xtime(uint8_t x)
+{
+    return static_cast<uint8_t>((x << 1) ^ ((x & 0x80) ? 0x1b : 0x00));
+}
+
+Aes128::Aes128()
+{
+    memset(mRoundKeys, 0, sizeof(mRoundKeys));
+}
+
+Aes128::Aes128(const QByteArray& key)
+{
+    setKey(key);
+}
+
+void Aes128::setKey(const QByteArray& key)
+{
+    memset(mRoundKeys, 0, sizeof(mRoundKeys));
+    memcpy(mRoundKeys, key.constData(), std::min<qsizetype>(key.size(), 16));
+
+    uint8_t rcon = 0x01;
+    for (int i = 16; i < 176; i += 4) {
+        uint8_t temp[4] = { mRoundKeys[i - 4], mRoundKeys[i - 3], mRoundKeys[i - 2], mRoundKeys[i - 1] };
+        if (i % 16 == 0) {
+            // rotate, substitute and mix in the round constant
+            const uint8_t first = temp[0];
+            temp[0] = sbox[temp[1]] ^ rcon;
+            temp[1] = sbox[temp[2]];
+            temp[2] = sbox[temp[3]];
+            temp[3] = sbox[first];
+            rcon = xtime(rcon);
+        }
+        for (int j = 0; j < 4; ++j) {
+            mRoundKeys[i + j] = mRoundKeys[i - 16 + j] ^ temp[j];
+        }
+    }
+}
+
+void Aes128::encryptBlock(const uint8_t* in, uint8_t* out) const
+{
+    uint8_t state[16];
+    for (int i = 0; i < 16; ++i) {
+        state[i] = in[i] ^ mRoundKeys[i];
+    }
+
+    for (int round = 1; round <= 10; ++round) {
+        // sub bytes and shift rows, the state is stored column by column
+        uint8_t shifted[16];
+        for (int c = 0; c < 4; ++c) {
+            for (int r = 0; r < 4; ++r) {
+                shifted[c * 4 + r] = sbox[state[((c + r) % 4) * 4 + r]];
+            }
+        }
+
+        if (round < 10) {
+            for (int c = 0; c < 4; ++c) {
+                uint8_t* col = shifted + c * 4;
+                const uint8_t all = col[0] ^ col[1] ^ col[2] ^ col[3];
+                const uint8_t first = col[0];
+                col[0] ^= all ^ xtime(col[0] ^ col[1]);
+                col[1] ^= all ^ xtime(col[1] ^ col[2]);
+                col[2] ^= all ^ xtime(col[2] ^ col[3]);
+                col[3] ^= all ^ xtime(col[3] ^ first);
+            }
+        }
+
+        const uint8_t* roundKey = mRoundKeys + round * 16;
+        for (int i = 0; i < 16; ++i) {
+            state[i] = shifted[i] ^ roundKey[i];
+        }
+    }
+
+    memcpy(out, state, 16);
+}
+
+static const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+Sha256::Sha256()
+{
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(mState, initial, sizeof(mState));
+    memset(mBuffer, 0, sizeof(mBuffer));
+}
+
+void Sha256::compress(const uint8_t* block)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = (static_cast<uint32_t>(block[i * 4]) << 24) | (static_cast<uint32_t>(block[i * 4 + 1]) << 16)
+            | (static_cast<uint32_t>(block[i * 4 + 2]) << 8) | static_cast<uint32_t>(block[i * 4 + 3]);
+    }
+    for (int i = 16; i < 64; ++i) {
+        const uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        const uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = mState[0], b = mState[1], c = mState[2], d = mState[3];
+    uint32_t e = mState[4], f = mState[5], g = mState[6], h = mState[7];
+    for (int i = 0; i < 64; ++i) {
+        const uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+        const uint32_t ch = (e & f) ^ (~e & g);
+        const uint32_t t1 = h + s1 + ch + sha256K[i] + w[i];
+        const uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+        const uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        const uint32_t t2 = s0 + maj;
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    mState[0] += a;
+    mState[1] += b;
+    mState[2] += c;
+    mState[3] += d;
+    mState[4] += e;
+    mState[5] += f;
+    mState[6] += g;
+    mState[7] += h;
+}
+
+void Sha256::update(const uint8_t* data, qsizetype size)
+{
+    mLength += static_cast<uint64_t>(size);
+    while (size > 0) {
+        const qsizetype chunk = std::min<qsizetype>(size, 64 - mBufferSize);
+        memcpy(mBuffer + mBufferSize, data, chunk);
+        mBufferSize += chunk;
+        data += chunk;
+        size -= chunk;
+        if (mBufferSize == 64) {
+            compress(mBuffer);
+            mBufferSize = 0;
+        }
+    }
+}
+
+void Sha256::finish(uint8_t* digest)
+{
+    const uint64_t bits = mLength * 8;
+    mBuffer[mBufferSize++] = 0x80;
+    if (mBufferSize > 56) {
+        memset(mBuffer + mBufferSize, 0, 64 - mBufferSize);
+        compress(mBuffer);
+        mBufferSize = 0;
+    }
+    memset(mBuffer + mBufferSize, 0, 56 - mBufferSize);
+    for (int i = 0; i < 8; ++i) {
+        mBuffer[56 + i] = static_cast<uint8_t>(bits >> (56 - i * 8));
+    }
+    compress(mBuffer);
+    mBufferSize = 0;
+
+    for (int i = 0; i < 8; ++i) {
+        digest[i * 4] = static_cast<uint8_t>(mState[i] >> 24);
+        digest[i * 4 + 1] = static_cast<uint8_t>(mState[i] >> 16);
+        digest[i * 4 + 2] = static_cast<uint8_t>(mState[i] >> 8);
+        digest[i * 4 + 3] = static_cast<uint8_t>(mState[i]);
+    }
+}
+
+void HmacSha256::setKey(const QByteArray& key)
+{
+    uint8_t block[64] = {};
+    if (key.size() > 64) {
+        Sha256 hash;
+        hash.update(reinterpret_cast<const uint8_t*>(key.constData()), key.size());
+        hash.finish(block);
+    } else {
+        memcpy(block, key.constData(), key.size());
+    }
+
+    uint8_t pad[64];
+    for (int i = 0; i < 64; ++i) {
+        pad[i] = block[i] ^ 0x36;
+    }
+    mInner = Sha256();
+    mInner.update(pad, 64);
+    for (int i = 0; i < 64; ++i) {
+        pad[i] = block[i] ^ 0x5c;
+    }
+    mOuter = Sha256();
+    mOuter.update(pad, 64);
+}
+
+void HmacSha256::mac(const uint8_t* data, qsizetype size, uint8_t* digest) const
+{
+    Sha256 inner = mInner;
+    inner.update(data, size);
+    uint8_t innerDigest[32];
+    inner.finish(innerDigest);
+
+    Sha256 outer = mOuter;
+    outer.update(innerDigest, 32);
+    outer.finish(digest);
+}
+
+PacketEncoder::PacketEncoder()
+{
+}
+
+PacketEncoder::PacketEncoder(const QByteArray& key)
+{
+    setKey(key);
+}
+
+void PacketEncoder::setKey(const QByteArray& key)
+{
+    mCipher.setKey(key);
+    mHmac.setKey(key);
+}
+
+void PacketEncoder::keystream(uint32_t seq, uint8_t* block) const
+{
+    keystream(seq, 0x8000, block);
+}
+
+void PacketEncoder::keystream(uint32_t seq, uint16_t source, uint8_t* block) const
+{
+    uint8_t iv[16] = {};
+    iv[0] = seq & 0xff;
+    iv[1] = (seq >> 8) & 0xff;
+    iv[2] = (seq >> 16) & 0xff;
+    iv[4] = source & 0xff;
+    iv[5] = source >> 8;
+    mCipher.encryptBlock(iv, block);
+}
+
+qsizetype PacketEncoder::encode(uint32_t seq, QByteArrayView data, uint8_t (&out)[MaxPacketSize]) const
+{
+    uint8_t block[16];
+    keystream(seq, block);
+    return encode(seq, block, data, out);
+}
+
+qsizetype PacketEncoder::encode(uint32_t seq, const uint8_t* keystream, QByteArrayView data, uint8_t (&out)[MaxPacketSize]) const
+{
+    if (data.size() > MaxDataSize) {
+        return -1;
+    }
+
+    const uint16_t source = 0x8000;
+    const uint8_t eof = 0xff;
+    // zero padded to the block size like QAESEncryption::ZERO
+    const qsizetype payloadSize = ((data.size() + 15) / 16) * 16;
+
+    // the hmac covers 8 zero bytes, the sequence number, the source and the
+    // payload. build it in place and move the header over afterwards
+    uint8_t prehmac[13 + MaxDataSize] = {};
+    prehmac[8] = seq & 0xff;
+    prehmac[9] = (seq >> 8) & 0xff;
+    prehmac[10] = (seq >> 16) & 0xff;
+    prehmac[11] = source & 0xff;
+    prehmac[12] = source >> 8;
+
+    uint8_t* payload = prehmac + 13;
+    if (!data.isEmpty()) {
+        memcpy(payload, data.data(), data.size());
+    }
+    uint8_t block[16];
+    memcpy(block, keystream, 16);
+    for (qsizetype off = 0; off < payloadSize; off += 16) {
+        if (off > 0) {
+            // ofb, the next keystream block is the encrypted previous one
+            mCipher.encryptBlock(block, block);
+        }
+        for (int i = 0; i < 16; ++i) {
+            payload[off + i] ^= block[i];
+        }
+    }
+
+    uint8_t hm[32];
+    mHmac.mac(prehmac, 13 + payloadSize, hm);
+
+    memcpy(out, prehmac + 8, 5);
+    memcpy(out + 5, payload, payloadSize);
+    // the hmac is reversed and truncated to 8 bytes
+    for (int i = 0; i < 8; ++i) {
+        out[5 + payloadSize + i] = hm[31 - i];
+    }
+    out[13 + payloadSize] = eof;
+    return 14 + payloadSize;
+}
+
+qsizetype PacketEncoder::decode(QByteArrayView packet, uint8_t (&out)[MaxDataSize], uint32_t* seq, uint16_t* source) const
+{
+    // packets from other mesh nodes aren't necessarily padded to the block size
+    const qsizetype payloadSize = packet.size() - 14;
+    if (payloadSize < 0 || payloadSize > MaxDataSize) {
+        return -1;
+    }
+    const auto in = reinterpret_cast<const uint8_t*>(packet.data());
+    if (in[13 + payloadSize] != 0xff) {
+        return -1;
+    }
+
+    uint8_t prehmac[13 + MaxDataSize] = {};
+    memcpy(prehmac + 8, in, 5);
+    memcpy(prehmac + 13, in + 5, payloadSize);
+    uint8_t hm[32];
+    mHmac.mac(prehmac, 13 + payloadSize, hm);
+    for (int i = 0; i < 8; ++i) {
+        if (in[5 + payloadSize + i] != hm[31 - i]) {
+            return -1;
+        }
+    }
+
+    const uint32_t packetSeq = in[0] | (in[1] << 8) | (in[2] << 16);
+    const uint16_t packetSource = static_cast<uint16_t>(in[3] | (in[4] << 8));
+    uint8_t block[16];
+    keystream(packetSeq, packetSource, block);
+    for (qsizetype off = 0; off < payloadSize; off += 16) {
+        if (off > 0) {
+            mCipher.encryptBlock(block, block);
+        }
+        const qsizetype blockSize = std::min<qsizetype>(16, payloadSize - off);
+        for (qsizetype i = 0; i < blockSize; ++i) {
+            out[off + i] = in[5 + off + i] ^ block[i];
+        }
+    }
+
+    if (seq) {
+        *seq = packetSeq;
+    }
+    if (source) {
+        *source = packetSource;
+    }
+    return payloadSize;
+}
+
 }
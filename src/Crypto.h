@@ -1,6 +1,7 @@
 #pragma once
 
 #include <QByteArray>
+#include <QByteArrayView>
 #include <cstdint>
 
 namespace crypto {
@@ -8,4 +9,77 @@ namespace crypto {
 QByteArray generateKey(const QByteArray& data);
 QByteArray makePacket(const QByteArray& key, int32_t seq, const QByteArray& data);
 
+// AES-128 block encryption with the key schedule expanded once up front
+class Aes128
+{
+public:
+    Aes128();
+    Aes128(const QByteArray& key);
+
+    void setKey(const QByteArray& key);
+    void encryptBlock(const uint8_t* in, uint8_t* out) const;
+
+private:
+    uint8_t mRoundKeys[176];
+};
+
+class Sha256
+{
+public:
+    Sha256();
+
+    void update(const uint8_t* data, qsizetype size);
+    void finish(uint8_t* digest);
+
+private:
+    void compress(const uint8_t* block);
+
+    uint32_t mState[8];
+    uint8_t mBuffer[64];
+    uint64_t mLength = 0;
+    qsizetype mBufferSize = 0;
+};
+
+// HMAC-SHA256 that keeps the hash state after the inner and outer pads so
+// they are only computed once per key
+class HmacSha256
+{
+public:
+    void setKey(const QByteArray& key);
+    void mac(const uint8_t* data, qsizetype size, uint8_t* digest) const;
+
+private:
+    Sha256 mInner, mOuter;
+};
+
+// Allocation free version of makePacket writing into a fixed buffer,
+// produces the same bytes. decode() verifies and decrypts a packet from any
+// source on the mesh.
+class PacketEncoder
+{
+public:
+    enum { MaxPacketSize = 64, MaxDataSize = 48 };
+
+    PacketEncoder();
+    PacketEncoder(const QByteArray& key);
+
+    void setKey(const QByteArray& key);
+
+    // first keystream block for a sequence number
+    void keystream(uint32_t seq, uint8_t* block) const;
+
+    // returns the packet size or -1 if data is larger than MaxDataSize
+    qsizetype encode(uint32_t seq, QByteArrayView data, uint8_t (&out)[MaxPacketSize]) const;
+    qsizetype encode(uint32_t seq, const uint8_t* keystream, QByteArrayView data, uint8_t (&out)[MaxPacketSize]) const;
+
+    // returns the payload size or -1 if the packet is malformed or the hmac doesn't match
+    qsizetype decode(QByteArrayView packet, uint8_t (&out)[MaxDataSize], uint32_t* seq = nullptr, uint16_t* source = nullptr) const;
+
+private:
+    void keystream(uint32_t seq, uint16_t source, uint8_t* block) const;
+
+    Aes128 mCipher;
+    HmacSha256 mHmac;
+};
+
 }
@@ -1,450 +1,1124 @@
 #include "HaloBluetooth.h"
 #include "Crypto.h"
-#include <QCoreApplication.h>
-#include <QPermissions>
+#include "Packets.h"
+#include <QDir>
 #include <QTimer>
 #include <QDebug>
-#include <cassert>
 
-HaloBluetooth::HaloBluetooth(uint32_t deviceDelay, Locations&& locations, QList<QBluetoothUuid>&& approved, QObject* parent)
-    : QObject(parent), mDeviceDelay(deviceDelay), mLocations(std::move(locations)), mApprovedDevices(std::move(approved))
+static uint32_t packetSequence(const QByteArray& csrpacket)
 {
-    qDebug() << "device delay" << mDeviceDelay;
-    mDiscoveryAgent = new QBluetoothDeviceDiscoveryAgent(this);
-    connect(mDiscoveryAgent, &QBluetoothDeviceDiscoveryAgent::deviceDiscovered,
-            this, &HaloBluetooth::deviceDiscovered);
+    const auto data = reinterpret_cast<const uint8_t*>(csrpacket.constData());
+    return data[0] | (data[1] << 8) | (data[2] << 16);
+}
+
+// how long a written packet waits for its echo before it is given up on, and
+// how long a sequence number is remembered. Relays trail the first copy by
+// far less
+static const qint64 sequenceTimeout = 10000000000ll;
+
+HaloBluetooth::HaloBluetooth(const Options& options, BluetoothTransport* transport, Location&& location, QList<QBluetoothUuid>&& approved, QObject* parent)
+    : QObject(parent), mGatewayCount(options.gateways), mPartialWrites(options.partialWrites),
+      mStateRefresh(static_cast<qint64>(options.stateRefresh) * 1000000000ll), mTransport(transport),
+      mLocation(std::move(location)), mPacer(options.minDeviceDelay, options.deviceDelay),
+      mApprovedDevices(approved.cbegin(), approved.cend()),
+      mConnectionProfiles(options.connectionProfiles)
+{
+    qDebug() << "location" << mLocation.id << "device delay" << options.minDeviceDelay << "to" << options.deviceDelay << "gateways" << mGatewayCount
+             << "partial writes" << mPartialWrites << "state refresh" << options.stateRefresh << "max connects" << options.maxConnects;
+    mPacketTimer.setSingleShot(true);
+    connect(&mPacketTimer, &QTimer::timeout, this, &HaloBluetooth::writeNextPacket);
+    mLowLatency.setIntervalRange(options.lowLatencyInterval, options.lowLatencyInterval);
+    mLowLatency.setLatency(0);
+    mLowLatency.setSupervisionTimeout(2000);
+    mPowerSaving.setIntervalRange(options.powerSavingInterval, options.powerSavingInterval);
+    // a standby link can be promoted to gateway at any time and written to
+    // straight away, skipping connection events would delay that command
+    mPowerSaving.setLatency(0);
+    mPowerSaving.setSupervisionTimeout(6000);
+    mProbeTimer.setSingleShot(true);
+    mProbeTimer.setInterval(2000);
+    connect(&mProbeTimer, &QTimer::timeout, this, &HaloBluetooth::framingProbeTimedOut);
+
+    // home of the sequence lease and the state snapshot, without it neither
+    // survives a restart
+    auto stateDir = options.stateDir;
+    if (!stateDir.isEmpty() && !QDir().mkpath(stateDir)) {
+        qDebug() << "unable to create state dir" << stateDir << "state will not be persisted";
+        stateDir.clear();
+    }
+
+    const auto key = crypto::generateKey(mLocation.passphrase.toUtf8() + QByteArray::fromHex("004d4350"));
+    // qDebug() << "key" << key.toHex();
+    mPacketBuilder.setKey(key);
+    mDecoder.setKey(key);
+    // sequence numbers only ever move forward so lights never take a
+    // command for a replay, the keystream for the upcoming ones is
+    // precomputed by the builder
+    if (!stateDir.isEmpty()) {
+        mSequences.load(QDir(stateDir).filePath(QStringLiteral("sequence-%1.bin").arg(mLocation.id)));
+    }
+    mPacketBuilder.setSequenceFunction([this]() { return mSequences.next(); });
+    scheduleRefill();
 
-    if (mLocations.size() > 0) {
-        // ### should improve this
-        mKey = crypto::generateKey(mLocations[0].passphrase.toUtf8() + QByteArray::fromHex("004d4350"));
-        // qDebug() << "key" << mKey.toHex();
+    for (const auto& group : mLocation.groups) {
+        auto& members = mGroups[groupAddress(group.gid)];
+        members = group.devices;
+        if (group.gid == 0 && members.isEmpty()) {
+            for (const auto& device : mLocation.devices) {
+                members.append(device.did);
+            }
+        }
+    }
+
+    if (!stateDir.isEmpty()) {
+        mSnapshotFile = QDir(stateDir).filePath(QStringLiteral("state-%1.bin").arg(mLocation.id));
+        mSnapshotTimer.setSingleShot(true);
+        mSnapshotTimer.setInterval(5000);
+        connect(&mSnapshotTimer, &QTimer::timeout, this, &HaloBluetooth::saveSnapshot);
+        if (mSnapshot.load(mSnapshotFile)) {
+            // known but never written by us, so nothing gets suppressed
+            const auto& lights = mSnapshot.lights();
+            for (auto it = lights.cbegin(), end = lights.cend(); it != end; ++it) {
+                auto& shadow = mShadows[it.key()];
+                shadow.brightness = it->brightness;
+                shadow.temperature = it->temperature;
+            }
+            mWarmStart = !lights.isEmpty();
+            qDebug() << "loaded state for" << lights.size() << "destinations and" << mSnapshot.devices().size() << "devices";
+        }
     }
 }
 
 HaloBluetooth::~HaloBluetooth()
 {
-    delete mDiscoveryAgent;
+    if (!mSnapshotFile.isEmpty()) {
+        saveSnapshot();
+    }
 }
 
-void HaloBluetooth::initialize()
+void HaloBluetooth::collectMetrics(metrics::Writer& writer, const QList<HaloBluetooth*>& bluetooths)
 {
-    auto app = QCoreApplication::instance();
-
-    QBluetoothPermission bluetoothPermission;
-    bluetoothPermission.setCommunicationModes(QBluetoothPermission::Access);
-    switch (app->checkPermission(bluetoothPermission)) {
-    case Qt::PermissionStatus::Undetermined:
-    case Qt::PermissionStatus::Denied:
-        // ask for permission
-        app->requestPermission(bluetoothPermission, this, [this](const QPermission& permission) {
-            switch (permission.status()) {
-            case Qt::PermissionStatus::Denied:
-                emit error(Error::PermissionError);
-                break;
-            case Qt::PermissionStatus::Granted:
-                emit ready();
-                break;
-            default:
-                // should never happen
-                assert(false && "Impossible impossibility");
-                break;
+    // a family at a time across all locations, every sample of a metric has
+    // to follow its description
+    auto perLocation = [&](const char* name, const char* help, auto&& value) {
+        writer.describe(name, "gauge", help);
+        for (const auto bluetooth : bluetooths) {
+            writer.sample(name).label("location", static_cast<uint64_t>(bluetooth->mLocation.id)).value(value(*bluetooth));
+        }
+    };
+    auto perDevice = [&](const char* name, const char* type, const char* help, auto&& value) {
+        writer.describe(name, type, help);
+        for (const auto bluetooth : bluetooths) {
+            for (const auto& dev : bluetooth->mDevices) {
+                writer.sample(name).label("location", static_cast<uint64_t>(bluetooth->mLocation.id)).label("device", dev.label).value(value(dev));
             }
-        });
-        break;
-    case Qt::PermissionStatus::Granted:
-        emit ready();
-        break;
+        }
+    };
+
+    perLocation("halo_pending_packets", "mesh packets waiting to be written", [](const HaloBluetooth& bt) {
+        return static_cast<uint64_t>(bt.mPendingPackets.size());
+    });
+    perLocation("halo_keystream_pool", "precomputed keystream blocks available", [](const HaloBluetooth& bt) {
+        return static_cast<uint64_t>(bt.mPacketBuilder.available());
+    });
+
+    writer.describe("halo_time_to_first_ready_seconds", "gauge", "time from starting discovery to the first ready device");
+    for (const auto bluetooth : bluetooths) {
+        if (bluetooth->mFirstReady != 0) {
+            writer.sample("halo_time_to_first_ready_seconds").label("location", static_cast<uint64_t>(bluetooth->mLocation.id)).value(static_cast<double>(bluetooth->mFirstReady) / 1e9);
+        }
+    }
+    writer.describe("halo_time_to_all_connected_seconds", "gauge", "time from starting discovery to every device being connected");
+    for (const auto bluetooth : bluetooths) {
+        if (bluetooth->mAllConnected != 0) {
+            writer.sample("halo_time_to_all_connected_seconds").label("location", static_cast<uint64_t>(bluetooth->mLocation.id)).value(static_cast<double>(bluetooth->mAllConnected) / 1e9);
+        }
     }
+    perLocation("halo_write_gap_seconds", "current gap between packet bursts", [](const HaloBluetooth& bt) {
+        return static_cast<double>(bt.mPacer.gap()) / 1000.;
+    });
+    perLocation("halo_write_loss_ratio", "smoothed ratio of failed packet bursts", [](const HaloBluetooth& bt) {
+        return bt.mPacer.loss();
+    });
+
+    perDevice("halo_device_pending_packets", "gauge", "packets held back until the device is ready again", [](const InternalDevice& dev) {
+        return static_cast<uint64_t>(dev.pendingPackets.size());
+    });
+    perDevice("halo_device_connects_total", "counter", "ble connects per device", [](const InternalDevice& dev) {
+        return static_cast<uint64_t>(dev.connectCount);
+    });
+    perDevice("halo_device_disconnects_total", "counter", "ble disconnects per device", [](const InternalDevice& dev) {
+        return static_cast<uint64_t>(dev.disconnectCount);
+    });
+    perDevice("halo_device_connect_backoff_seconds", "gauge", "current reconnect backoff per device", [](const InternalDevice& dev) {
+        return static_cast<double>(dev.connectBackoff) / 1000.;
+    });
+    perDevice("halo_device_ready", "gauge", "whether the device can be written to", [](const InternalDevice& dev) {
+        return static_cast<uint64_t>(dev.ready ? 1 : 0);
+    });
+    perDevice("halo_device_gateway", "gauge", "whether the device is a selected gateway", [](const InternalDevice& dev) {
+        return static_cast<uint64_t>(dev.gateway ? 1 : 0);
+    });
+    perDevice("halo_device_single_write", "gauge", "whether packets go out in one write instead of two", [](const InternalDevice& dev) {
+        return static_cast<uint64_t>(dev.framing == InternalDevice::Framing::Single ? 1 : 0);
+    });
+    perDevice("halo_device_low_latency", "gauge", "whether the low latency connection profile was requested", [](const InternalDevice& dev) {
+        return static_cast<uint64_t>(dev.profile == InternalDevice::Profile::LowLatency ? 1 : 0);
+    });
+    perDevice("halo_device_connection_interval_seconds", "gauge", "negotiated connection interval", [](const InternalDevice& dev) {
+        return dev.connectionInterval / 1000.;
+    });
+    perDevice("halo_device_connection_latency", "gauge", "negotiated peripheral latency in connection events", [](const InternalDevice& dev) {
+        return static_cast<uint64_t>(dev.connectionLatency);
+    });
+    perDevice("halo_device_supervision_timeout_seconds", "gauge", "negotiated supervision timeout", [](const InternalDevice& dev) {
+        return static_cast<double>(dev.supervisionTimeout) / 1000.;
+    });
 }
 
 void HaloBluetooth::rediscover()
 {
-    if (mDiscoveryAgent) {
-        QObject::disconnect(mDiscoveryAgent, &QBluetoothDeviceDiscoveryAgent::deviceDiscovered,
-                            this, &HaloBluetooth::deviceDiscovered);
-        mDiscoveryAgent->deleteLater();
-    }
-    mDiscoveryAgent = new QBluetoothDeviceDiscoveryAgent(this);
-    QObject::connect(mDiscoveryAgent, &QBluetoothDeviceDiscoveryAgent::deviceDiscovered,
-                     this, &HaloBluetooth::deviceDiscovered);
-    mDiscoveryAgent->start(QBluetoothDeviceDiscoveryAgent::LowEnergyMethod);
+    mTransport->rediscover();
 }
 
-void HaloBluetooth::startDiscovery()
+void HaloBluetooth::start()
 {
-    // qDebug() << "discovering";
-    mDiscoveryAgent->start(QBluetoothDeviceDiscoveryAgent::LowEnergyMethod);
+    mDiscoveryStarted = metrics::now();
+
+    // connect straight away to devices seen on a previous run, the scan runs
+    // in parallel and refreshes any address that has gone stale
+    const auto cached = mSnapshot.devices();
+    for (const auto& info : cached) {
+        if (mApprovedDevices.contains(deviceId(info))) {
+            qDebug() << "connecting to cached device" << deviceId(info) << "rssi" << info.rssi();
+            addDevice(info);
+        }
+    }
 }
 
-void HaloBluetooth::addDevice(const QBluetoothDeviceInfo& info)
+void HaloBluetooth::addDevice(const QBluetoothDeviceInfo& info, bool fromScan)
 {
-    auto recreateController = [this](InternalDevice& idev) {
-        idev.controller = QLowEnergyController::createCentral(idev.info, this);
-        QObject::connect(idev.controller, &QLowEnergyController::serviceDiscovered,
-                         this, &HaloBluetooth::deviceServiceDiscovered);
-        QObject::connect(idev.controller, &QLowEnergyController::errorOccurred,
-                         this, &HaloBluetooth::deviceErrorOccurred);
-        QObject::connect(idev.controller, &QLowEnergyController::connected,
-                         this, &HaloBluetooth::deviceConnected);
-        QObject::connect(idev.controller, &QLowEnergyController::disconnected,
-                         this, &HaloBluetooth::deviceDisconnected);
-    };
-
-    auto dit = std::find_if(mDevices.begin(), mDevices.end(),
-                            [&info](const auto& other) {
-                                return info.deviceUuid() == other.info.deviceUuid();
-                            });
-    if (dit != mDevices.end()) {
+    auto dit = findDevice(deviceId(info));
+    if (dit != nullptr) {
+        if (fromScan && !dit->discovered) {
+            // first advert for a device connected from the cache
+            dit->discovered = true;
+            const bool stale = dit->info.address() != info.address();
+            dit->info = info;
+            if (!mSnapshotFile.isEmpty()) {
+                mSnapshot.setDevice(info);
+                scheduleSnapshot();
+            }
+            if (stale && dit->link && !dit->connected) {
+                qDebug() << "cached address stale for" << deviceId(info);
+                // its connect slot is freed with the link
+                releaseLink(*dit);
+                dit->connecting = false;
+            }
+        }
         // already added?
-        if (!dit->controller) {
-            recreateController(*dit);
-            dit->connecting = true;
-            dit->controller->connectToDevice();
+        if (!dit->link) {
+            requestConnect(*dit);
         }
         return;
     }
 
-    auto ait = std::find(mApprovedDevices.begin(), mApprovedDevices.end(), info.deviceUuid());
-    if (ait == mApprovedDevices.end()) {
+    if (!mApprovedDevices.contains(deviceId(info))) {
         // not approved
-        qDebug() << "device not approved" << info.deviceUuid();
+        qDebug() << "device not approved" << deviceId(info);
         return;
     }
 
     InternalDevice dev = {
         info,
     };
+    dev.discovered = fromScan;
+    // what the platform calls the device, the uuid on Apple and the address elsewhere
+    dev.label = info.deviceUuid().isNull() ? info.address().toString().toUtf8() : info.deviceUuid().toString(QUuid::WithoutBraces).toUtf8();
 
-    recreateController(dev);
-    dev.connecting = true;
-    dev.controller->connectToDevice();
-
+    mDeviceIndex.insert(deviceId(info), mDevices.size());
     mDevices.append(std::move(dev));
+    requestConnect(mDevices.last());
+
+    if (!mSnapshotFile.isEmpty()) {
+        mSnapshot.setDevice(info);
+        scheduleSnapshot();
+    }
 }
 
 void HaloBluetooth::deviceConnected()
 {
-    auto controller = static_cast<QLowEnergyController*>(sender());
+    auto link = static_cast<BluetoothLink*>(sender());
 
-    auto it = std::find_if(mDevices.begin(), mDevices.end(),
-                           [controller](const auto& other) {
-                               return controller == other.controller;
-                           });
-    if (it == mDevices.end()) {
+    auto it = findDevice(link);
+    if (it == nullptr) {
         qDebug() << "no device for connected?";
         return;
     }
 
-    controller->discoverServices();
+    link->discoverServices();
     ++it->connectCount;
     it->connecting = false;
     it->connected = true;
     it->connectBackoff = 0;
+
+    if (mAllConnected == 0 && mDiscoveryStarted != 0 && mDevices.size() == mLocation.devices.size()) {
+        const bool allConnected = std::all_of(mDevices.cbegin(), mDevices.cend(), [](const auto& dev) {
+            return dev.connected;
+        });
+        if (allConnected) {
+            mAllConnected = metrics::now() - mDiscoveryStarted;
+            qDebug() << "all devices connected after" << (mAllConnected / 1000000) << "ms";
+        }
+    }
 }
 
 void HaloBluetooth::deviceDisconnected()
 {
-    auto controller = static_cast<QLowEnergyController*>(sender());
-    qDebug() << "device disconnected" << controller->remoteDeviceUuid();
+    auto link = static_cast<BluetoothLink*>(sender());
+    qDebug() << "device disconnected" << deviceId(link->info());
 
-    auto it = std::find_if(mDevices.begin(), mDevices.end(),
-                           [controller](const auto& other) {
-                               return controller == other.controller;
-                           });
-    if (it == mDevices.end()) {
+    auto it = findDevice(link);
+    if (it == nullptr) {
         qDebug() << "no device for disconnected?";
         return;
     }
 
     it->ready = it->connecting = it->connected = false;
+    ++it->disconnectCount;
+    updateGateways();
+    if (mPacer.isPending()) {
+        // the burst may not have made it out
+        mPacer.failed();
+    }
+
+    releaseLink(*it);
+}
+
+HaloBluetooth::InternalDevice* HaloBluetooth::findDevice(const QBluetoothUuid& uuid)
+{
+    const auto idx = mDeviceIndex.value(uuid, -1);
+    return idx >= 0 ? &mDevices[idx] : nullptr;
+}
+
+HaloBluetooth::InternalDevice* HaloBluetooth::findDevice(const BluetoothLink* link)
+{
+    const auto idx = mLinkIndex.value(link, -1);
+    return idx >= 0 ? &mDevices[idx] : nullptr;
+}
 
-    QObject::disconnect(it->service, &QLowEnergyService::stateChanged, this, &HaloBluetooth::serviceStateChanged);
-    QObject::disconnect(it->service, &QLowEnergyService::errorOccurred, this, &HaloBluetooth::serviceErrorOccurred);
-    QObject::disconnect(it->service, &QLowEnergyService::characteristicChanged, this, &HaloBluetooth::serviceCharacteristicChanged);
-    QObject::disconnect(it->service, &QLowEnergyService::descriptorWritten, this, &HaloBluetooth::serviceDescriptorWritten);
-    it->service->deleteLater();
-    it->service = nullptr;
+void HaloBluetooth::createLink(InternalDevice& device)
+{
+    device.link = mTransport->createLink(device.info, this);
+    mLinkIndex.insert(device.link, mDeviceIndex.value(deviceId(device.info)));
+    QObject::connect(device.link, &BluetoothLink::ready,
+                     this, &HaloBluetooth::deviceReady);
+    QObject::connect(device.link, &BluetoothLink::errorOccurred,
+                     this, &HaloBluetooth::deviceErrorOccurred);
+    QObject::connect(device.link, &BluetoothLink::serviceErrorOccurred,
+                     this, &HaloBluetooth::serviceErrorOccurred);
+    QObject::connect(device.link, &BluetoothLink::connected,
+                     this, &HaloBluetooth::deviceConnected);
+    QObject::connect(device.link, &BluetoothLink::disconnected,
+                     this, &HaloBluetooth::deviceDisconnected);
+    QObject::connect(device.link, &BluetoothLink::written,
+                     this, &HaloBluetooth::deviceWritten);
+    QObject::connect(device.link, &BluetoothLink::writeFailed,
+                     this, &HaloBluetooth::deviceWriteFailed);
+    QObject::connect(device.link, &BluetoothLink::packetReceived,
+                     this, &HaloBluetooth::devicePacketReceived);
+    QObject::connect(device.link, &BluetoothLink::connectionUpdated,
+                     this, &HaloBluetooth::deviceConnectionUpdated);
+}
 
-    QObject::disconnect(it->controller, &QLowEnergyController::serviceDiscovered,
-                        this, &HaloBluetooth::deviceServiceDiscovered);
-    QObject::disconnect(it->controller, &QLowEnergyController::errorOccurred,
+void HaloBluetooth::releaseLink(InternalDevice& device)
+{
+    QObject::disconnect(device.link, &BluetoothLink::ready,
+                        this, &HaloBluetooth::deviceReady);
+    QObject::disconnect(device.link, &BluetoothLink::errorOccurred,
                         this, &HaloBluetooth::deviceErrorOccurred);
-    QObject::disconnect(it->controller, &QLowEnergyController::connected,
+    QObject::disconnect(device.link, &BluetoothLink::serviceErrorOccurred,
+                        this, &HaloBluetooth::serviceErrorOccurred);
+    QObject::disconnect(device.link, &BluetoothLink::connected,
                         this, &HaloBluetooth::deviceConnected);
-    QObject::disconnect(it->controller, &QLowEnergyController::disconnected,
+    QObject::disconnect(device.link, &BluetoothLink::disconnected,
                         this, &HaloBluetooth::deviceDisconnected);
-    it->controller->deleteLater();
-    it->controller = nullptr;
+    QObject::disconnect(device.link, &BluetoothLink::written,
+                        this, &HaloBluetooth::deviceWritten);
+    QObject::disconnect(device.link, &BluetoothLink::writeFailed,
+                        this, &HaloBluetooth::deviceWriteFailed);
+    QObject::disconnect(device.link, &BluetoothLink::packetReceived,
+                        this, &HaloBluetooth::devicePacketReceived);
+    QObject::disconnect(device.link, &BluetoothLink::connectionUpdated,
+                        this, &HaloBluetooth::deviceConnectionUpdated);
+    device.profile = InternalDevice::Profile::Default;
+    device.connectionInterval = 0.;
+    device.connectionLatency = device.supervisionTimeout = 0;
+    mLinkIndex.remove(device.link);
+    device.link->deleteLater();
+    device.link = nullptr;
 }
 
 void HaloBluetooth::deviceErrorOccurred(QLowEnergyController::Error error)
 {
-    auto controller = static_cast<QLowEnergyController*>(sender());
+    auto link = static_cast<BluetoothLink*>(sender());
     qDebug() << "device error" << error;
 
-    auto it = std::find_if(mDevices.begin(), mDevices.end(),
-                           [controller](const auto& other) {
-                               return controller == other.controller;
-                           });
-    if (it == mDevices.end()) {
+    auto it = findDevice(link);
+    if (it == nullptr) {
         qDebug() << "no device for error?";
         return;
     }
     if (it->connecting && !it->connected) {
         it->connecting = false;
-        // reconnect later
+        // a fresh link for the retry, the transport may pick another adapter
+        releaseLink(*it);
+
+        // reconnect later, jittered so devices that failed together don't
+        // all come back at the same time
         it->connectBackoff = std::min<uint32_t>(30000, it->connectBackoff ? it->connectBackoff * 5 : 100);
-        QTimer::singleShot(it->connectBackoff, [this, controller]() {
-            auto sit = std::find_if(mDevices.begin(), mDevices.end(),
-                                    [controller](const auto& other) {
-                                        return controller == other.controller;
-                                    });
-            if (sit == mDevices.end()) {
+        const auto delay = it->connectBackoff / 2 + mRandom.bounded(it->connectBackoff + 1);
+        const auto uuid = deviceId(it->info);
+        QTimer::singleShot(delay, this, [this, uuid]() {
+            auto sit = findDevice(uuid);
+            if (sit == nullptr) {
                 qDebug() << "no device for backoff reconnect?";
                 return;
             }
-            if (!sit->connecting && !sit->connected) {
-                addDevice(sit->info);
-                if (!sit->connecting) {
-                    sit->connecting = true;
-                    controller->connectToDevice();
-                }
-            }
+            requestConnect(*sit);
         });
     }
 }
 
-void HaloBluetooth::deviceServiceDiscovered(const QBluetoothUuid& service)
+void HaloBluetooth::requestConnect(InternalDevice& device)
 {
-    // qDebug() << "device new service" << service;
-    static const QUuid aviOnService = QUuid::fromString("0000fef1-0000-1000-8000-00805f9b34fb");
-    if (service.operator==(aviOnService)) {
-        auto controller = static_cast<QLowEnergyController*>(sender());
-        auto it = std::find_if(mDevices.begin(), mDevices.end(),
-                               [controller](const auto& other) {
-                                   return controller == other.controller;
-                               });
-        if (it == mDevices.end()) {
-            qDebug() << "no device for service?";
-            return;
-        }
-
-        auto serviceObject = controller->createServiceObject(service, this);
-        if (serviceObject == nullptr) {
-            qDebug() << "no service for avi-on service uuid";
-            return;
-        }
-
-        QObject::connect(serviceObject, &QLowEnergyService::stateChanged, this, &HaloBluetooth::serviceStateChanged);
-        QObject::connect(serviceObject, &QLowEnergyService::errorOccurred, this, &HaloBluetooth::serviceErrorOccurred);
-        QObject::connect(serviceObject, &QLowEnergyService::characteristicChanged, this, &HaloBluetooth::serviceCharacteristicChanged);
-        QObject::connect(serviceObject, &QLowEnergyService::descriptorWritten, this, &HaloBluetooth::serviceDescriptorWritten);
-        serviceObject->discoverDetails();
+    if (device.connected || device.connecting) {
+        return;
+    }
+    // queued by the transport until the link's adapter has a free slot
+    device.connecting = true;
+    if (!device.link) {
+        createLink(device);
+    }
+    mTransport->requestConnect(device.link, connectPriority(device));
+}
 
-        it->service = serviceObject;
+int HaloBluetooth::connectPriority(const InternalDevice& device) const
+{
+    // former gateways first, then devices whose last connect worked, then
+    // by signal strength
+    int priority = device.info.rssi() != 0 ? device.info.rssi() : -128;
+    if (device.wasGateway) {
+        priority += 2000;
+    }
+    if (device.connectCount > 0 && device.connectBackoff == 0) {
+        priority += 1000;
     }
+    return priority;
 }
 
 void HaloBluetooth::deviceDiscovered(const QBluetoothDeviceInfo& info)
 {
     if (!(info.coreConfigurations() & QBluetoothDeviceInfo::LowEnergyCoreConfiguration)) {
+        metrics::increment(metrics::Counter::AdvertsFiltered);
         return;
     }
-    // qDebug() << "discovered" << info.deviceUuid() << info.name();
+    // qDebug() << "discovered" << deviceId(info) << info.name();
+    // the csrmesh service is not in every advert, the name is the fallback
+    static const QBluetoothUuid aviOnService(static_cast<quint16>(0xfef1));
     static const QString aviOn = "Avi-on";
-    if (info.name() == aviOn) {
-        addDevice(info);
+    if (!info.serviceUuids().contains(aviOnService) && info.name() != aviOn) {
+        metrics::increment(metrics::Counter::AdvertsFiltered);
+        return;
     }
+    metrics::increment(metrics::Counter::AdvertsAccepted);
+    addDevice(info, true);
 }
 
-void HaloBluetooth::serviceCharacteristicChanged(const QLowEnergyCharacteristic& characteristic, const QByteArray& value)
+void HaloBluetooth::serviceErrorOccurred(QLowEnergyService::ServiceError error)
 {
-    // qDebug() << "service char changed" << characteristic.uuid() << characteristic.name() << value;
+    qDebug() << "service error" << error;
 }
 
-void HaloBluetooth::serviceDescriptorWritten(const QLowEnergyDescriptor& descriptor, const QByteArray& value)
+void HaloBluetooth::deviceWritten()
 {
-    // qDebug() << "service descr written" << descriptor.uuid() << descriptor.name() << value;
+    mPacer.completed();
+    if (hasPendingPackets()) {
+        // the gap may have shrunk
+        scheduleNextPacket();
+    }
 }
 
-void HaloBluetooth::serviceErrorOccurred(QLowEnergyService::ServiceError error)
+void HaloBluetooth::deviceWriteFailed()
 {
-    qDebug() << "service error" << error;
+    mPacer.failed();
+    metrics::increment(metrics::Counter::WriteFailures);
+    qDebug() << "write failed, gap now" << mPacer.gap() << "loss" << mPacer.loss();
+
+    // a single write the firmware refused, split again until probed anew
+    auto device = findDevice(static_cast<BluetoothLink*>(sender()));
+    if (device != nullptr && device->framing == InternalDevice::Framing::Single) {
+        device->framing = InternalDevice::Framing::Unknown;
+    }
 }
 
-void HaloBluetooth::serviceStateChanged(QLowEnergyService::ServiceState state)
-{
-    auto service = static_cast<QLowEnergyService*>(sender());
-    switch (state) {
-    case QLowEnergyService::RemoteServiceDiscovering:
-        // qDebug() << "service discovering" << service;
-        break;
-    case QLowEnergyService::RemoteServiceDiscovered: {
-        auto it = std::find_if(mDevices.begin(), mDevices.end(),
-                               [service](const auto& other) {
-                                   return service == other.service;
-                               });
-        if (it == mDevices.end()) {
-            qDebug() << "no device for characteristic?";
-            return;
-        }
-
-        // for (const auto& charr : service->characteristics()) {
-        //     qDebug() << charr.name() << charr.uuid();
-        // }
-
-        static const QUuid characteristicLow = QUuid::fromString("c4edc000-9daf-11e3-8003-00025b000b00");
-        static const QUuid characteristicHigh = QUuid::fromString("c4edc000-9daf-11e3-8004-00025b000b00");
-        const auto low = service->characteristic(characteristicLow);
-        const auto high = service->characteristic(characteristicHigh);
-        if (low.isValid() && high.isValid()) {
-            it->low = low;
-            it->high = high;
-            it->ready = true;
-            qDebug() << "device ready" << it->info.deviceUuid();
-
-            if (mDevices.size() == firstLocation()->devices.size()) {
-                bool allReady = true;
-                for (const auto& dev : mDevices) {
-                    if (!dev.ready) {
-                        allReady = false;
-                        break;
-                    }
-                }
-                if (allReady) {
-                    writePendingPackets();
-                    // can this get to >1 if the device disconnects during initialization?
-                    if (it->connectCount == 1) {
-                        emit devicesReady();
-                    }
-                }
+void HaloBluetooth::devicePacketReceived(const QByteArray& packet)
+{
+    if (mProbeTimer.isActive() && packet.size() >= 3 && packetSequence(packet) == mProbeSequence) {
+        mProbeTimer.stop();
+        if (auto device = findDevice(mProbeDevice)) {
+            qDebug() << "single writes work for" << mProbeDevice;
+            device->framing = InternalDevice::Framing::Single;
+        }
+    }
+
+    if (confirmWrite(packet)) {
+        return;
+    }
+    // every device relays every packet, only the first copy is worth verifying
+    if (packet.size() < 3 || hasSeenSequence(packetSequence(packet))) {
+        return;
+    }
+
+    uint8_t payload[crypto::PacketEncoder::MaxDataSize];
+    uint32_t seq;
+    const auto size = mDecoder.decode(packet, payload, &seq);
+    if (size < 0) {
+        qDebug() << "undecodable mesh packet" << packet.toHex();
+        return;
+    }
+    rememberSequence(seq);
+
+    uint16_t destination;
+    LightState state;
+    if (!packets::parse(QByteArrayView(payload, size), &destination, &state)) {
+        qDebug() << "unknown mesh payload" << QByteArray(reinterpret_cast<const char*>(payload), size).toHex();
+        return;
+    }
+    qDebug() << "mesh state changed" << destination;
+    discardDevicePackets(destination, state);
+    updateShadow(destination, state, metrics::now());
+    emit stateChanged(destination, state);
+}
+
+bool HaloBluetooth::hasSeenSequence(uint32_t seq) const
+{
+    return mSeenSeqs.contains(seq);
+}
+
+void HaloBluetooth::rememberSequence(uint32_t seq)
+{
+    const auto now = metrics::now();
+    pruneSequences(now);
+    mSeenSeqs.insert(seq, now);
+}
+
+void HaloBluetooth::pruneSequences(qint64 now)
+{
+    // at most once a second
+    if (now - mSequencesPruned < 1000000000ll) {
+        return;
+    }
+    mSequencesPruned = now;
+    mSeenSeqs.removeIf([now](const auto& it) {
+        return now - it.value() > sequenceTimeout;
+    });
+    // echoes lost for good
+    mUnconfirmed.removeIf([now](const auto& it) {
+        return now - it.value().written > sequenceTimeout;
+    });
+}
+
+void HaloBluetooth::rememberWrite(uint32_t seq, const PacketQueue::Packet& packet)
+{
+    rememberSequence(seq);
+    mUnconfirmed.insert(seq, { packet, metrics::now() });
+}
+
+bool HaloBluetooth::confirmWrite(const QByteArray& packet)
+{
+    if (packet.size() < 3) {
+        return false;
+    }
+    const auto it = mUnconfirmed.constFind(packetSequence(packet));
+    if (it == mUnconfirmed.cend()) {
+        return false;
+    }
+    // a matching sequence number alone could be anyone's packet, verified once
+    // here and the copies relayed by the other devices are dropped as seen
+    uint8_t payload[crypto::PacketEncoder::MaxDataSize];
+    if (mDecoder.decode(packet, payload) < 0) {
+        return false;
+    }
+    uint16_t destination;
+    LightState state;
+    if (packets::parse(it->packet.data, &destination, &state)) {
+        confirmShadow(destination, state, metrics::now());
+    }
+    mUnconfirmed.erase(it);
+    return true;
+}
+
+LightState HaloBluetooth::knownState(uint16_t destination) const
+{
+    const auto shadow = mShadows.constFind(destination);
+    if (shadow == mShadows.cend()) {
+        return {};
+    }
+    return { shadow->brightness, shadow->temperature };
+}
+
+void HaloBluetooth::deviceReady()
+{
+    auto link = static_cast<BluetoothLink*>(sender());
+    auto it = findDevice(link);
+    if (it == nullptr) {
+        qDebug() << "no device for characteristic?";
+        return;
+    }
+
+    it->ready = true;
+    qDebug() << "device ready" << deviceId(it->info) << (it->discovered ? "discovered" : "cached");
+    updateConnectionProfiles();
+    if (mFirstReady == 0 && mDiscoveryStarted != 0) {
+        mFirstReady = metrics::now() - mDiscoveryStarted;
+        qDebug() << "first device ready after" << (mFirstReady / 1000000) << "ms";
+    }
+
+    if (mGatewayCount > 0) {
+        const bool hadGateway = hasReadyGateway();
+        updateGateways();
+        if (!hadGateway && hasReadyGateway()) {
+            writePendingPackets();
+        }
+    } else if (mPartialWrites) {
+        writePendingPackets();
+        if (!it->pendingPackets.isEmpty()) {
+            qDebug() << "replaying" << it->pendingPackets.size() << "packets to" << deviceId(it->info);
+            scheduleNextPacket();
+        }
+    }
+
+    if (mDevices.size() == mLocation.devices.size()) {
+        bool allReady = true;
+        for (const auto& dev : mDevices) {
+            if (!dev.ready) {
+                allReady = false;
+                break;
+            }
+        }
+        if (allReady) {
+            writePendingPackets();
+            // can this get to >1 if the device disconnects during initialization?
+            if (it->connectCount == 1) {
+                emit devicesReady();
             }
         }
-        // qDebug() << "service discovered" << service << low.isValid() << high.isValid();
-        break; }
-    default:
-        break;
     }
 }
 
-void HaloBluetooth::setBrightness(uint8_t deviceId, uint8_t brightness)
+void HaloBluetooth::setBrightness(uint16_t destination, uint8_t brightness, qint64 ingress)
 {
-    QByteArray packet = QByteArray::fromHex("808073000A0000000000000000");
-    packet[0] += deviceId;
-    packet[8] = brightness;
-    qDebug() << "wanting to write brightness" << packet.toHex();
+    setState(destination, { brightness, {} }, ingress);
+}
 
-    writePacket(packet);
+void HaloBluetooth::setColorTemperature(uint16_t destination, uint16_t temperature, qint64 ingress)
+{
+    setState(destination, { {}, temperature }, ingress);
 }
 
-void HaloBluetooth::setColorTemperature(uint8_t deviceId, uint16_t temperature)
+void HaloBluetooth::setState(uint16_t destination, const LightState& state, qint64 ingress)
 {
-    uint8_t tempBuf[2];
-    memcpy(tempBuf, &temperature, 2);
+    LightState changed = state;
+    const auto shadow = mShadows.constFind(destination);
+    if (mStateRefresh > 0 && shadow != mShadows.cend()) {
+        // identical to what the mesh last confirmed and not due for a refresh. Anything
+        // still queued for the attribute is older and must not go out either
+        const auto now = metrics::now();
+        if (state.brightness.has_value() && shadow->brightness == state.brightness && shadow->brightnessConfirmed != 0 && now - shadow->brightnessConfirmed < mStateRefresh) {
+            changed.brightness.reset();
+            mPendingPackets.discard({ destination, PacketQueue::Attribute::Brightness });
+            metrics::increment(metrics::Counter::WritesSuppressed);
+        }
+        if (state.temperature.has_value() && shadow->temperature == state.temperature && shadow->temperatureConfirmed != 0 && now - shadow->temperatureConfirmed < mStateRefresh) {
+            changed.temperature.reset();
+            mPendingPackets.discard({ destination, PacketQueue::Attribute::ColorTemperature });
+            metrics::increment(metrics::Counter::WritesSuppressed);
+        }
+        if (packets::count(changed) < packets::count(state)) {
+            qDebug() << "suppressing unchanged state for" << destination;
+        }
+    }
 
-    QByteArray packet = QByteArray::fromHex("808073001D0000000100000000");
-    packet[0] += deviceId;
-    // big endian
-    packet[9] += tempBuf[1];
-    packet[10] += tempBuf[0];
-    qDebug() << "wanting to write temperature" << packet.toHex();
+    // one packet per attribute, all of them written in the same burst
+    QList<PacketQueue::Packet> burst;
+    burst.reserve(packets::count(changed));
+    if (changed.brightness.has_value()) {
+        burst.append({ destination, PacketQueue::Attribute::Brightness, packets::brightness(destination, changed.brightness.value()), ingress });
+    }
+    if (changed.temperature.has_value()) {
+        burst.append({ destination, PacketQueue::Attribute::ColorTemperature, packets::temperature(destination, changed.temperature.value()), ingress });
+    }
+    if (burst.isEmpty()) {
+        return;
+    }
+    for (const auto& packet : burst) {
+        qDebug() << "wanting to write" << packet.data.toHex();
+    }
+    metrics::recordStage(metrics::Stage::Enqueued, mLocation.id, destination, ingress);
 
-    writePacket(packet);
+    writePackets(burst);
 }
 
-uint32_t HaloBluetooth::randomSeq()
+void HaloBluetooth::scheduleRefill()
 {
-    return mRandom.bounded(1, 16777215);
+    if (mRefillScheduled || mPacketBuilder.isFull()) {
+        return;
+    }
+    // top up the keystream pool once the event loop is done with the current writes
+    mRefillScheduled = true;
+    QTimer::singleShot(0, this, [this]() {
+        mRefillScheduled = false;
+        mPacketBuilder.refill();
+    });
 }
 
 void HaloBluetooth::writePendingPackets()
 {
-    QList<QByteArray> pendingPackets;
+    // bursts that can't go out yet end up queued again, in order
+    PacketQueue pendingPackets;
     std::swap(pendingPackets, mPendingPackets);
-    for (const auto& packet : pendingPackets) {
-        writePacket(packet);
+    while (!pendingPackets.isEmpty()) {
+        writePackets(pendingPackets.takeBurst());
     }
 }
 
 void HaloBluetooth::scheduleNextPacket()
 {
-    if (mScheduledPacket) {
-        return;
-    }
-    mScheduledPacket = true;
-    QTimer::singleShot(mDeviceDelay, this, &HaloBluetooth::writeNextPacket);
+    // restarting is fine, the remaining time is measured from the last burst
+    mPacketTimer.start(std::max<uint32_t>(mPacer.remaining(metrics::now()), 1));
 }
 
 void HaloBluetooth::writeNextPacket()
 {
-    mWritingPacket = false;
-    mScheduledPacket = false;
     if (mPendingPackets.isEmpty()) {
+        replayDevicePackets();
         return;
     }
-    // this is not pretty
-    QList<QByteArray> pendingPackets;
-    std::swap(pendingPackets, mPendingPackets);
-    for (const auto& packet : pendingPackets) {
-        writePacket(packet);
+    writePendingPackets();
+}
+
+void HaloBluetooth::replayDevicePackets()
+{
+    if (mPacer.remaining(metrics::now()) > 0) {
+        scheduleNextPacket();
+        return;
+    }
+    // one burst to each device that has caught up, paced like any other burst
+    uint32_t writes = 0;
+    bool replayed = false;
+    for (auto& device : mDevices) {
+        if (!device.ready || device.pendingPackets.isEmpty()) {
+            continue;
+        }
+        const auto burst = device.pendingPackets.takeBurst();
+        replayed = true;
+        for (const auto& packet : burst) {
+            writes += encryptDevicePacket(device, packet);
+            metrics::recordStage(metrics::Stage::Written, mLocation.id, packet.destination, packet.ingress);
+        }
+    }
+    if (!replayed) {
+        return;
+    }
+    mPacer.started(metrics::now(), writes);
+    scheduleRefill();
+    if (hasPendingPackets()) {
+        scheduleNextPacket();
+    }
+}
+
+bool HaloBluetooth::hasPendingPackets() const
+{
+    if (!mPendingPackets.isEmpty()) {
+        return true;
+    }
+    for (const auto& dev : mDevices) {
+        if (dev.ready && !dev.pendingPackets.isEmpty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void HaloBluetooth::updateGateways()
+{
+    if (mGatewayCount == 0) {
+        return;
+    }
+    uint32_t gateways = 0;
+    for (auto& dev : mDevices) {
+        if (dev.gateway && !dev.ready) {
+            qDebug() << "gateway lost" << deviceId(dev.info);
+            dev.gateway = false;
+        } else if (dev.gateway) {
+            ++gateways;
+        }
+    }
+    while (gateways < mGatewayCount) {
+        // spread the gateways over the adapters, then prefer the device that
+        // has had to reconnect the least
+        QHash<int, uint32_t> adapterGateways;
+        for (const auto& dev : mDevices) {
+            if (dev.gateway) {
+                ++adapterGateways[dev.link->adapter()];
+            }
+        }
+        InternalDevice* candidate = nullptr;
+        uint32_t candidateGateways = 0;
+        for (auto& dev : mDevices) {
+            if (!dev.ready || dev.gateway) {
+                continue;
+            }
+            const auto shared = adapterGateways.value(dev.link->adapter());
+            if (!candidate || shared < candidateGateways || (shared == candidateGateways && dev.connectCount < candidate->connectCount)) {
+                candidate = &dev;
+                candidateGateways = shared;
+            }
+        }
+        if (candidate == nullptr) {
+            break;
+        }
+        qDebug() << "gateway selected" << deviceId(candidate->info);
+        candidate->gateway = candidate->wasGateway = true;
+        ++gateways;
+    }
+    updateConnectionProfiles();
+}
+
+void HaloBluetooth::updateConnectionProfiles()
+{
+    if (!mConnectionProfiles) {
+        return;
+    }
+    for (auto& dev : mDevices) {
+        if (!dev.ready) {
+            continue;
+        }
+        // in gateway mode only the gateways carry commands, the rest stand by.
+        // Without gateways every link carries commands
+        const auto profile = mGatewayCount == 0 || dev.gateway
+            ? InternalDevice::Profile::LowLatency
+            : InternalDevice::Profile::PowerSaving;
+        if (dev.profile != profile) {
+            dev.profile = profile;
+            dev.link->requestConnectionUpdate(profile == InternalDevice::Profile::LowLatency ? mLowLatency : mPowerSaving);
+        }
+    }
+}
+
+void HaloBluetooth::deviceConnectionUpdated(const QLowEnergyConnectionParameters& parameters)
+{
+    auto device = findDevice(static_cast<BluetoothLink*>(sender()));
+    if (device == nullptr) {
+        return;
+    }
+    // the interval range collapses to the one in use
+    device->connectionInterval = parameters.maximumInterval();
+    device->connectionLatency = parameters.latency();
+    device->supervisionTimeout = parameters.supervisionTimeout();
+    qDebug() << "connection updated" << deviceId(device->info) << "interval" << device->connectionInterval
+             << "latency" << device->connectionLatency << "timeout" << device->supervisionTimeout;
+}
+
+bool HaloBluetooth::hasReadyGateway() const
+{
+    for (const auto& dev : mDevices) {
+        if (dev.gateway && dev.ready) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t HaloBluetooth::writeDevicePacket(InternalDevice& device, const QByteArray& csrpacket)
+{
+    // the att header takes 3 bytes of the mtu
+    if (device.framing == InternalDevice::Framing::Single && device.link->mtu() - 3 >= csrpacket.size()) {
+        device.link->write(BluetoothLink::Characteristic::High, csrpacket);
+        return device.link->confirmsWrites() ? 1 : 0;
+    }
+
+    const auto& csrlow = csrpacket.mid(0, 20);
+    const auto& csrhigh = csrpacket.mid(20);
+
+    // qDebug() << "writing csr" << csrpacket.size();
+    device.link->write(BluetoothLink::Characteristic::Low, csrlow);
+    device.link->write(BluetoothLink::Characteristic::High, csrhigh);
+    return device.link->confirmsWrites() ? 1 : 0;
+}
+
+uint32_t HaloBluetooth::encryptDevicePacket(InternalDevice& device, const PacketQueue::Packet& packet)
+{
+    const auto& csrpacket = mPacketBuilder.makePacket(packet.data);
+    metrics::increment(metrics::Counter::PacketsEncrypted);
+    metrics::recordStage(metrics::Stage::Encrypted, mLocation.id, packet.destination, packet.ingress);
+    rememberWrite(packetSequence(csrpacket), packet);
+    const auto writes = writeDevicePacket(device, csrpacket);
+    return writes + probeFraming(device, packet, csrpacket.size());
+}
+
+uint32_t HaloBluetooth::probeFraming(InternalDevice& device, const PacketQueue::Packet& packet, qsizetype packetSize)
+{
+    if (device.framing != InternalDevice::Framing::Unknown || mProbeTimer.isActive() || device.link->mtu() - 3 < packetSize) {
+        return 0;
     }
+    // the same command again in a single write under its own sequence number.
+    // Commands are absolute so the lights applying it twice does no harm, and
+    // the mesh relaying it back shows the firmware took it
+    const auto& csrpacket = mPacketBuilder.makePacket(packet.data);
+    metrics::increment(metrics::Counter::PacketsEncrypted);
+    device.framing = InternalDevice::Framing::Probing;
+    mProbeDevice = deviceId(device.info);
+    mProbeSequence = packetSequence(csrpacket);
+    rememberWrite(mProbeSequence, packet);
+    mProbeTimer.start();
+    qDebug() << "probing single writes to" << mProbeDevice << "mtu" << device.link->mtu();
+    device.link->write(BluetoothLink::Characteristic::High, csrpacket);
+    return device.link->confirmsWrites() ? 1 : 0;
 }
 
-void HaloBluetooth::writePacketInternal(const QByteArray& packet)
+void HaloBluetooth::framingProbeTimedOut()
 {
+    auto device = findDevice(mProbeDevice);
+    if (device == nullptr) {
+        return;
+    }
+    if (!device->ready) {
+        // lost the link, try again once it is back
+        device->framing = InternalDevice::Framing::Unknown;
+        return;
+    }
+    qDebug() << "no echo for single write, splitting writes to" << mProbeDevice;
+    device->framing = InternalDevice::Framing::Split;
+}
+
+void HaloBluetooth::writePacketsInternal(const QList<PacketQueue::Packet>& burst)
+{
+    if (mGatewayCount > 0) {
+        // the mesh relays the packet to the other lights so one encryption
+        // through the selected gateways is enough
+        uint32_t writes = 0;
+        for (const auto& packet : burst) {
+            const auto& csrpacket = mPacketBuilder.makePacket(packet.data);
+            metrics::increment(metrics::Counter::PacketsEncrypted);
+            metrics::recordStage(metrics::Stage::Encrypted, mLocation.id, packet.destination, packet.ingress);
+            rememberWrite(packetSequence(csrpacket), packet);
+            for (auto& device : mDevices) {
+                if (device.gateway && device.ready) {
+                    writes += writeDevicePacket(device, csrpacket);
+                    writes += probeFraming(device, packet, csrpacket.size());
+                }
+            }
+            updateShadow(packet);
+            metrics::recordStage(metrics::Stage::Written, mLocation.id, packet.destination, packet.ingress);
+        }
+        mPacer.started(metrics::now(), writes);
+        scheduleRefill();
+        return;
+    }
+
     //qDebug() << "num devices" << mDevices.size();
+    uint32_t writes = 0;
+    qsizetype devices = 0;
     for (auto& device : mDevices) {
         if (!device.ready) {
-            return;
+            if (!mPartialWrites) {
+                break;
+            }
+            // replayed once the device is ready again
+            for (const auto& packet : burst) {
+                device.pendingPackets.enqueue(packet);
+            }
+            continue;
+        }
+
+        for (const auto& packet : burst) {
+            // anything older for the same target must not be replayed over this
+            device.pendingPackets.discard(packet);
+            writes += encryptDevicePacket(device, packet);
+        }
+        ++devices;
+    }
+    mPacer.started(metrics::now(), writes);
+    if (devices == 0 || (!mPartialWrites && devices < mDevices.size())) {
+        return;
+    }
+    for (const auto& packet : burst) {
+        updateShadow(packet);
+        metrics::recordStage(metrics::Stage::Written, mLocation.id, packet.destination, packet.ingress);
+    }
+    scheduleRefill();
+}
+
+const QList<uint32_t>* HaloBluetooth::groupMembers(uint16_t destination) const
+{
+    const auto group = mGroups.constFind(destination);
+    if (group == mGroups.cend()) {
+        return nullptr;
+    }
+    return &group.value();
+}
+
+void HaloBluetooth::updateShadow(const PacketQueue::Packet& packet)
+{
+    uint16_t destination;
+    LightState state;
+    if (packets::parse(packet.data, &destination, &state)) {
+        updateShadow(destination, state, 0);
+    }
+}
+
+void HaloBluetooth::updateShadow(uint16_t destination, const LightState& state, qint64 confirmed)
+{
+    const auto members = groupMembers(destination);
+    const auto memberOf = [members, destination](uint16_t other) {
+        return members ? members->contains(static_cast<uint32_t>(other - 0x8080)) : other == destination;
+    };
+    // groups sharing a light with this destination no longer have a known state
+    for (auto it = mShadows.begin(); it != mShadows.end();) {
+        const auto otherMembers = groupMembers(it.key());
+        if (it.key() != destination && otherMembers != nullptr
+            && std::any_of(otherMembers->cbegin(), otherMembers->cend(), [&memberOf](uint32_t did) { return memberOf(deviceAddress(did)); })) {
+            it = mShadows.erase(it);
+        } else {
+            ++it;
         }
-        if (!device.low.isValid() || !device.high.isValid()) {
-            //qDebug() << "characteristic not valid" << device.low.isValid() << device.high.isValid();
-            return;
+    }
+
+    const auto apply = [&state, confirmed](Shadow& shadow) {
+        if (state.brightness.has_value()) {
+            shadow.brightness = state.brightness;
+            shadow.brightnessConfirmed = confirmed;
+        }
+        if (state.temperature.has_value()) {
+            shadow.temperature = state.temperature;
+            shadow.temperatureConfirmed = confirmed;
+        }
+    };
+    apply(mShadows[destination]);
+    if (members) {
+        for (const auto did : *members) {
+            apply(mShadows[deviceAddress(did)]);
+        }
+    }
+    scheduleSnapshot();
+}
+
+void HaloBluetooth::confirmShadow(uint16_t destination, const LightState& state, qint64 confirmed)
+{
+    // only while nothing newer was written or seen since
+    const auto apply = [&state, confirmed](Shadow& shadow) {
+        if (state.brightness.has_value() && shadow.brightness == state.brightness) {
+            shadow.brightnessConfirmed = confirmed;
+        }
+        if (state.temperature.has_value() && shadow.temperature == state.temperature) {
+            shadow.temperatureConfirmed = confirmed;
+        }
+    };
+    const auto shadow = mShadows.find(destination);
+    if (shadow != mShadows.end()) {
+        apply(shadow.value());
+    }
+    if (const auto members = groupMembers(destination)) {
+        for (const auto did : *members) {
+            const auto member = mShadows.find(deviceAddress(did));
+            if (member != mShadows.end()) {
+                apply(member.value());
+            }
+        }
+    }
+}
+
+void HaloBluetooth::discardDevicePackets(uint16_t destination, const LightState& state)
+{
+    // e.g. a wall switch turned the light off while a link was down, the
+    // older command replayed once it is back would turn it on again
+    const auto discard = [this, &state](uint16_t address) {
+        for (auto& device : mDevices) {
+            if (state.brightness.has_value()) {
+                device.pendingPackets.discard({ address, PacketQueue::Attribute::Brightness });
+            }
+            if (state.temperature.has_value()) {
+                device.pendingPackets.discard({ address, PacketQueue::Attribute::ColorTemperature });
+            }
         }
+    };
+    discard(destination);
+    if (const auto members = groupMembers(destination)) {
+        for (const auto did : *members) {
+            discard(deviceAddress(did));
+        }
+    }
+}
 
-        const auto& csrpacket = crypto::makePacket(mKey, randomSeq(), packet);
-        const auto& csrlow = csrpacket.mid(0, 20);
-        const auto& csrhigh = csrpacket.mid(20);
+void HaloBluetooth::scheduleSnapshot()
+{
+    // not restarted, so a steady stream of changes still gets saved
+    if (mSnapshotFile.isEmpty() || mSnapshotTimer.isActive()) {
+        return;
+    }
+    mSnapshotTimer.start();
+}
 
-        // qDebug() << "writing csr" << csrpacket.size();
-        device.service->writeCharacteristic(device.low, csrlow, QLowEnergyService::WriteWithoutResponse);
-        device.service->writeCharacteristic(device.high, csrhigh, QLowEnergyService::WriteWithoutResponse);
+void HaloBluetooth::saveSnapshot()
+{
+    mSnapshotTimer.stop();
+    mSnapshot.clearLights();
+    for (auto it = mShadows.cbegin(), end = mShadows.cend(); it != end; ++it) {
+        mSnapshot.setLight(it.key(), { it->brightness, it->temperature });
     }
+    mSnapshot.save(mSnapshotFile);
 }
 
-void HaloBluetooth::writePacket(const QByteArray& packet)
+void HaloBluetooth::writePackets(const QList<PacketQueue::Packet>& burst)
 {
-    bool allReady = true, anyConnected = false;
+    bool allReady = true, anyReady = false, anyConnected = false;
     for (auto& dev : mDevices) {
         if (!dev.connected) {
-            qDebug() << "reconnecting" << dev.info.deviceUuid();
             if (!dev.connecting) {
-                addDevice(dev.info);
-                if (!dev.connecting) {
-                    dev.connecting = true;
-                    dev.controller->connectToDevice();
-                }
+                qDebug() << "reconnecting" << deviceId(dev.info);
+                requestConnect(dev);
             }
             allReady = false;
         } else if (!dev.ready) {
             allReady = false;
             anyConnected = true;
         } else {
-            anyConnected = true;
+            anyConnected = anyReady = true;
         }
     }
     if (!anyConnected) {
         rediscover();
     }
-    if (!allReady || mWritingPacket) {
-        mPendingPackets.append(packet);
-        if (allReady) {
+    // in gateway mode one ready gateway is enough to reach the mesh, with
+    // partial writes any ready device is and the others catch up later
+    bool canWrite = allReady;
+    if (mGatewayCount > 0) {
+        canWrite = hasReadyGateway();
+    } else if (mPartialWrites) {
+        canWrite = anyReady;
+    }
+    if (!canWrite || mPacer.remaining(metrics::now()) > 0) {
+        for (const auto& packet : burst) {
+            mPendingPackets.enqueue(packet);
+        }
+        if (canWrite) {
             scheduleNextPacket();
         }
         return;
     }
-    mWritingPacket = true;
-    writePacketInternal(packet);
+    writePacketsInternal(burst);
 }
 
 #include "moc_HaloBluetooth.cpp"
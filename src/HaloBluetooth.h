@@ -1,95 +1,202 @@
 #pragma once
 
+#include "BluetoothTransport.h"
 #include "Locations.h"
+#include "Metrics.h"
+#include "Options.h"
+#include "PacketBuilder.h"
+#include "Packets.h"
+#include "PacketQueue.h"
+#include "SequenceAllocator.h"
+#include "StateSnapshot.h"
+#include "WritePacer.h"
 #include <QObject>
-#include <QBluetoothDeviceDiscoveryAgent>
+#include <QHash>
+#include <QSet>
 #include <QBluetoothDeviceInfo>
-#include <QLowEnergyCharacteristic>
 #include <QLowEnergyController>
 #include <QLowEnergyService>
 #include <QRandomGenerator>
+#include <QTimer>
 #include <cstdint>
 
 class HaloBluetooth : public QObject
 {
     Q_OBJECT
 public:
-    enum class Error { PermissionError };
-
-    HaloBluetooth(uint32_t deviceDelay, Locations&& locations, QList<QBluetoothUuid>&& approved, QObject* parent);
+    HaloBluetooth(const Options& options, BluetoothTransport* transport, Location&& location, QList<QBluetoothUuid>&& approved, QObject* parent);
     ~HaloBluetooth();
 
-    void initialize();
-    void startDiscovery();
+    // connects to cached devices, the transport is shared between locations
+    // so the scan is started by the caller
+    void start();
 
-    const Locations& locations() const;
-    const Location* firstLocation() const;
+    const Location& location() const;
 
-signals:
-    void error(Error error);
-    void ready();
+    // the last state written to or seen for a destination
+    LightState knownState(uint16_t destination) const;
+    // whether states were restored from --state-dir
+    bool isWarmStart() const;
 
+    static void collectMetrics(metrics::Writer& writer, const QList<HaloBluetooth*>& bluetooths);
+
+signals:
     void devicesReady();
+    // a state change seen on the mesh, from a wall switch, the app or another bridge
+    void stateChanged(uint16_t destination, const LightState& state);
 
 public slots:
-    void setBrightness(uint8_t deviceId, uint8_t brightness);
-    void setColorTemperature(uint8_t deviceId, uint16_t temperature);
+    // destination is a csrmesh address, see deviceAddress() and groupAddress()
+    void setBrightness(uint16_t destination, uint8_t brightness, qint64 ingress = 0);
+    void setColorTemperature(uint16_t destination, uint16_t temperature, qint64 ingress = 0);
+    void setState(uint16_t destination, const LightState& state, qint64 ingress = 0);
 
-private slots:
+    // an advert from one of the location's devices, routed by AdvertRouter
     void deviceDiscovered(const QBluetoothDeviceInfo& info);
+
+private slots:
     void deviceConnected();
     void deviceDisconnected();
     void deviceErrorOccurred(QLowEnergyController::Error error);
-    void deviceServiceDiscovered(const QBluetoothUuid& service);
-    void serviceCharacteristicChanged(const QLowEnergyCharacteristic& characteristic, const QByteArray& value);
-    void serviceDescriptorWritten(const QLowEnergyDescriptor& descriptor, const QByteArray& value);
+    void deviceReady();
     void serviceErrorOccurred(QLowEnergyService::ServiceError error);
-    void serviceStateChanged(QLowEnergyService::ServiceState state);
+    void deviceWritten();
+    void deviceWriteFailed();
+    void devicePacketReceived(const QByteArray& packet);
+    void deviceConnectionUpdated(const QLowEnergyConnectionParameters& parameters);
 
 private slots:
     void writeNextPacket();
+    void saveSnapshot();
+    void framingProbeTimedOut();
 
 private:
-    void writePacketInternal(const QByteArray& packet);
-    void writePacket(const QByteArray& packet);
-    void addDevice(const QBluetoothDeviceInfo& info);
-    uint32_t randomSeq();
+    void writePacketsInternal(const QList<PacketQueue::Packet>& burst);
+    void writePackets(const QList<PacketQueue::Packet>& burst);
+    // a written state is only confirmed once its echo comes back from the mesh,
+    // a state seen on the mesh is confirmed as it is
+    void updateShadow(const PacketQueue::Packet& packet);
+    void updateShadow(uint16_t destination, const LightState& state, qint64 confirmed);
+    void confirmShadow(uint16_t destination, const LightState& state, qint64 confirmed);
+    // drops backlogged packets a state seen on the mesh has overtaken
+    void discardDevicePackets(uint16_t destination, const LightState& state);
+    void scheduleSnapshot();
+    bool hasSeenSequence(uint32_t seq) const;
+    void rememberSequence(uint32_t seq);
+    void pruneSequences(qint64 now);
+    // a packet we wrote, confirmed by confirmWrite() when its echo arrives
+    void rememberWrite(uint32_t seq, const PacketQueue::Packet& packet);
+    bool confirmWrite(const QByteArray& packet);
+    const QList<uint32_t>* groupMembers(uint16_t destination) const;
+    void addDevice(const QBluetoothDeviceInfo& info, bool fromScan = false);
+    void updateGateways();
+    bool hasReadyGateway() const;
+    void scheduleRefill();
 
     struct InternalDevice
     {
         QBluetoothDeviceInfo info;
-        QLowEnergyController* controller = nullptr;
-        QLowEnergyService* service = nullptr;
-        QLowEnergyCharacteristic low = {}, high = {};
-        uint32_t connectCount = 0, connectBackoff = 0;
+        BluetoothLink* link = nullptr;
+        QByteArray label = {};
+        uint32_t connectCount = 0, disconnectCount = 0, connectBackoff = 0;
         bool connected = false, connecting = false, ready = false;
+        bool gateway = false, wasGateway = false;
+        // seen advertising since startup, otherwise connected from the cache
+        bool discovered = false;
+        // whether a packet can go out in one write to the high
+        // characteristic instead of being split over low and high
+        enum class Framing { Unknown, Probing, Single, Split } framing = Framing::Unknown;
+        // the requested connection profile and what the link agreed to
+        enum class Profile { Default, LowLatency, PowerSaving } profile = Profile::Default;
+        double connectionInterval = 0.;
+        int connectionLatency = 0, supervisionTimeout = 0;
+        // packets missed while not ready, see --partial-writes
+        PacketQueue pendingPackets = {};
     };
 
+    InternalDevice* findDevice(const QBluetoothUuid& uuid);
+    InternalDevice* findDevice(const BluetoothLink* link);
+    void createLink(InternalDevice& device);
+    void releaseLink(InternalDevice& device);
+    void requestConnect(InternalDevice& device);
+    int connectPriority(const InternalDevice& device) const;
+    // these return how many confirmations the writes will bring, see WritePacer
+    uint32_t writeDevicePacket(InternalDevice& device, const QByteArray& csrpacket);
+    uint32_t probeFraming(InternalDevice& device, const PacketQueue::Packet& packet, qsizetype packetSize);
+    void updateConnectionProfiles();
+    uint32_t encryptDevicePacket(InternalDevice& device, const PacketQueue::Packet& packet);
+    void replayDevicePackets();
+    bool hasPendingPackets() const;
     void writePendingPackets();
     void scheduleNextPacket();
     void rediscover();
 
+    // the last state written to or seen for a destination and when the mesh
+    // confirmed it, 0 while unconfirmed
+    struct Shadow
+    {
+        std::optional<uint8_t> brightness = {};
+        std::optional<uint16_t> temperature = {};
+        qint64 brightnessConfirmed = 0, temperatureConfirmed = 0;
+    };
+
+    struct Unconfirmed
+    {
+        PacketQueue::Packet packet = {};
+        qint64 written = 0;
+    };
+
 private:
-    uint32_t mDeviceDelay;
-    Locations mLocations;
+    uint32_t mGatewayCount;
+    bool mPartialWrites;
+    qint64 mStateRefresh;
+    BluetoothTransport* mTransport;
+    Location mLocation;
     QRandomGenerator mRandom;
-    QByteArray mKey;
-    QList<QBluetoothUuid> mApprovedDevices;
-    QBluetoothDeviceDiscoveryAgent* mDiscoveryAgent = nullptr;
+    SequenceAllocator mSequences;
+    PacketBuilder mPacketBuilder;
+    crypto::PacketEncoder mDecoder;
+    WritePacer mPacer;
+    QTimer mPacketTimer;
+    QSet<QBluetoothUuid> mApprovedDevices;
+    // devices are only ever appended, so the indexes stay valid
     QList<InternalDevice> mDevices;
-    QList<QByteArray> mPendingPackets;
-    bool mWritingPacket = false, mScheduledPacket = false;
+    QHash<QBluetoothUuid, qsizetype> mDeviceIndex;
+    QHash<const BluetoothLink*, qsizetype> mLinkIndex;
+    PacketQueue mPendingPackets;
+    QHash<uint16_t, Shadow> mShadows;
+    QHash<uint16_t, QList<uint32_t>> mGroups;
+    // sequence numbers of packets written and received and when, to drop
+    // echoes and packets relayed by more than one device. Kept for a time
+    // rather than a count, every device relays every packet
+    QHash<uint32_t, qint64> mSeenSeqs;
+    // written packets by sequence number until their echo is seen
+    QHash<uint32_t, Unconfirmed> mUnconfirmed;
+    qint64 mSequencesPruned = 0;
+    StateSnapshot mSnapshot;
+    QString mSnapshotFile;
+    QTimer mSnapshotTimer;
+    bool mWarmStart = false;
+    // from startDiscovery() to the first device becoming ready and to every
+    // device in the location being connected
+    qint64 mDiscoveryStarted = 0, mFirstReady = 0, mAllConnected = 0;
+    bool mRefillScheduled = false;
+    // one framing probe at a time, see probeFraming()
+    QBluetoothUuid mProbeDevice;
+    uint32_t mProbeSequence = 0;
+    QTimer mProbeTimer;
+    // links that carry commands go low latency, standby links save power,
+    // see --connection-profiles
+    QLowEnergyConnectionParameters mLowLatency, mPowerSaving;
+    bool mConnectionProfiles;
 };
 
-inline const Locations& HaloBluetooth::locations() const
+inline const Location& HaloBluetooth::location() const
 {
-    return mLocations;
+    return mLocation;
 }
 
-inline const Location* HaloBluetooth::firstLocation() const
+inline bool HaloBluetooth::isWarmStart() const
 {
-    if (mLocations.isEmpty()) {
-        return nullptr;
-    }
-    return &mLocations[0];
+    return mWarmStart;
 }
@@ -1,48 +1,123 @@
 #include "HaloManager.h"
+#include "Metrics.h"
+#include "QtBluetoothTransport.h"
+#include "SimulatedTransport.h"
 #include <QCoreApplication>
+#include <QHash>
 #include <QList>
 #include <QFile>
 #include <QString>
 #include <cstdio>
 
-inline QList<QBluetoothUuid> uuidsFromFile(const QString& fn)
+// one device per line, its uuid on Apple and its address elsewhere, see
+// deviceId(), optionally followed by the id of the location the device
+// belongs to, devices without one belong to the first location
+static QHash<uint32_t, QList<QBluetoothUuid>> approvedFromFile(const QString& fn, uint32_t defaultLocation)
 {
     QFile file(fn);
     if (!file.open(QFile::ReadOnly)) {
         return {};
     }
-    const auto preuuids = file.readAll().split('\n');
+    const auto lines = file.readAll().split('\n');
     file.close();
-    QList<QBluetoothUuid> uuids;
-    uuids.reserve(preuuids.size());
-    for (const auto& pre : preuuids) {
-        if (!pre.isEmpty()) {
-            uuids.append(QBluetoothUuid(QUuid::fromString(pre.trimmed())));
+    QHash<uint32_t, QList<QBluetoothUuid>> approved;
+    for (const auto& line : lines) {
+        const auto columns = line.simplified().split(' ');
+        if (columns.first().isEmpty()) {
+            continue;
         }
+        auto locationId = defaultLocation;
+        if (columns.size() > 1) {
+            bool ok;
+            locationId = columns[1].toUInt(&ok);
+            if (!ok) {
+                qDebug() << "invalid location for device" << columns[0];
+                continue;
+            }
+        }
+        const QBluetoothAddress address(QString::fromLatin1(columns[0]));
+        approved[locationId].append(address.isNull() ? QBluetoothUuid(QUuid::fromString(columns[0])) : deviceId(address));
+    }
+    return approved;
+}
+
+static LightState lightState(std::optional<uint8_t> brightness, std::optional<uint32_t> temperature)
+{
+    LightState state = { brightness, {} };
+    if (temperature.has_value()) {
+        state.temperature = static_cast<uint16_t>(temperature.value());
     }
-    return uuids;
+    return state;
 }
 
 HaloManager::HaloManager(Options&& options, QObject* parent)
     : QObject(parent), mOptions(std::move(options))
 {
-    mBluetooth = new HaloBluetooth(mOptions.deviceDelay, locationsFromFile(mOptions.locations), uuidsFromFile(mOptions.devices), this);
-    QObject::connect(mBluetooth, &HaloBluetooth::ready, this, &HaloManager::bluetoothReady);
-    QObject::connect(mBluetooth, &HaloBluetooth::error, this, &HaloManager::bluetoothError);
-    QObject::connect(mBluetooth, &HaloBluetooth::devicesReady, this, &HaloManager::devicesReady);
-    mBluetooth->initialize();
+    auto locations = locationsFromFile(mOptions.locations);
+    auto approved = approvedFromFile(mOptions.devices, locations.isEmpty() ? 0 : locations.first().id);
+    QList<QBluetoothUuid> lights;
+    for (const auto& uuids : approved) {
+        lights.append(uuids);
+    }
+    if (mOptions.simulate) {
+        mTransport = new SimulatedTransport(mOptions, locations, lights, this);
+    } else {
+        mTransport = new QtBluetoothTransport(mOptions, lights, this);
+    }
+    QObject::connect(mTransport, &BluetoothTransport::ready, this, &HaloManager::bluetoothReady);
+    QObject::connect(mTransport, &BluetoothTransport::error, this, &HaloManager::bluetoothError);
+
+    for (auto& location : locations) {
+        auto uuids = approved.take(location.id);
+        const auto locationUuids = uuids;
+        auto bluetooth = new HaloBluetooth(mOptions, mTransport, std::move(location), std::move(uuids), this);
+        mAdverts.addDevices(locationUuids, bluetooth);
+        QObject::connect(bluetooth, &HaloBluetooth::devicesReady, this, &HaloManager::devicesReady);
+        QObject::connect(bluetooth, &HaloBluetooth::stateChanged, this, &HaloManager::meshStateChanged);
+        mBluetooths.append(bluetooth);
+    }
+    for (auto it = approved.cbegin(), end = approved.cend(); it != end; ++it) {
+        qDebug() << "devices for unknown location" << it.key() << it.value();
+    }
+    QObject::connect(mTransport, &BluetoothTransport::deviceDiscovered, this, [this](const QBluetoothDeviceInfo& info) {
+        mAdverts.route(info);
+    });
+    metrics::addCollector(this, [this](metrics::Writer& writer) {
+        HaloBluetooth::collectMetrics(writer, mBluetooths);
+    });
+    mTransport->initialize();
 
     mMqtt = new HaloMqtt(mOptions);
     QObject::connect(mMqtt, &HaloMqtt::connected, this, &HaloManager::mqttConnected);
     QObject::connect(mMqtt, &HaloMqtt::stateRequested, this, &HaloManager::mqttStateRequested);
+    QObject::connect(mMqtt, &HaloMqtt::groupStateRequested, this, &HaloManager::mqttGroupStateRequested);
     QObject::connect(mMqtt, &HaloMqtt::idle, this, &HaloManager::mqttIdle);
     mMqtt->connect();
+
+    if (mOptions.metricsPort > 0) {
+        mMetricsServer = new MetricsServer(mOptions.metricsPort, this);
+    }
 }
 
 HaloManager::~HaloManager()
 {
+    metrics::removeCollector(this);
+    delete mMetricsServer;
     delete mMqtt;
-    delete mBluetooth;
+    for (auto bluetooth : mBluetooths) {
+        delete bluetooth;
+    }
+    delete mTransport;
+}
+
+HaloBluetooth* HaloManager::bluetooth(uint32_t locationId) const
+{
+    for (const auto bluetooth : mBluetooths) {
+        if (bluetooth->location().id == locationId) {
+            return bluetooth;
+        }
+    }
+    return nullptr;
 }
 
 void HaloManager::quit()
@@ -51,67 +126,150 @@ void HaloManager::quit()
         return;
     }
     mQuitting = true;
-    const auto location = mBluetooth->firstLocation();
-    if (location->devices.isEmpty() || !mMqtt->isConnected()) {
-        QCoreApplication::instance()->quit();
-    } else {
-        for (const auto& dev : location->devices) {
-            mMqtt->unpublishDevice(location->id, dev.did);
+    bool unpublished = false;
+    if (mMqtt->isConnected()) {
+        for (const auto bluetooth : mBluetooths) {
+            const auto& location = bluetooth->location();
+            for (const auto& dev : location.devices) {
+                mMqtt->unpublishDevice(location.id, dev.did);
+                unpublished = true;
+            }
+            for (const auto& group : location.groups) {
+                mMqtt->unpublishGroup(location.id, group.gid);
+                unpublished = true;
+            }
         }
     }
+    if (!unpublished) {
+        QCoreApplication::instance()->quit();
+    }
 }
 
 void HaloManager::bluetoothReady()
 {
-    mBluetooth->startDiscovery();
+    for (const auto bluetooth : mBluetooths) {
+        bluetooth->start();
+    }
+    // one scan serves every location
+    mTransport->startDiscovery();
 }
 
-void HaloManager::bluetoothError(HaloBluetooth::Error error)
+void HaloManager::bluetoothError(BluetoothTransport::Error error)
 {
     fprintf(stderr, "bluetooth error 0x%x", static_cast<uint32_t>(error));
 }
 
 void HaloManager::devicesReady()
 {
-    qDebug() << "devices are ready";
-    mDevicesReady = true;
+    auto bluetooth = static_cast<HaloBluetooth*>(sender());
+    qDebug() << "devices are ready for location" << bluetooth->location().id;
+    mReadyLocations.insert(bluetooth->location().id);
     if (!mMqtt->isConnected()) {
         qDebug() << "- mqtt not connected";
         return;
     }
-    const auto location = mBluetooth->firstLocation();
-    for (const auto& dev : location->devices) {
-        // mBluetooth->setBrightness(dev.did, 200);
-        // mBluetooth->setColorTemperature(dev.did, 5000);
-        mMqtt->publishDevice(location->id, dev);
-        mMqtt->publishDeviceState(location->id, dev.did, 255, 3333);
-    }
+    publishLocation(bluetooth);
 }
 
 void HaloManager::mqttConnected()
 {
-    if (!mDevicesReady) {
-        return;
-    }
     qDebug() << "republishing devices to mqtt";
-    const auto location = mBluetooth->firstLocation();
+    for (const auto bluetooth : mBluetooths) {
+        // with a restored snapshot the last known state goes out right away
+        if (mReadyLocations.contains(bluetooth->location().id) || bluetooth->isWarmStart()) {
+            publishLocation(bluetooth);
+        }
+    }
+}
+
+void HaloManager::publishLocation(const HaloBluetooth* bluetooth)
+{
+    const auto& location = bluetooth->location();
+    // only states that have been written or seen on the mesh, the retained
+    // state is better than a guess
+    for (const auto& dev : location.devices) {
+        mMqtt->publishDevice(location.id, dev);
+        const auto state = bluetooth->knownState(deviceAddress(dev.did));
+        if (state.brightness.has_value()) {
+            mMqtt->updateDeviceState(location.id, static_cast<uint8_t>(dev.did), state.brightness, state.temperature);
+        }
+    }
+    for (const auto& group : location.groups) {
+        mMqtt->publishGroup(location.id, group);
+        const auto state = bluetooth->knownState(groupAddress(group.gid));
+        if (state.brightness.has_value()) {
+            mMqtt->updateGroupState(location.id, group.gid, state.brightness, state.temperature);
+        }
+    }
+}
+
+void HaloManager::updateGroupMembers(const Location& location, const Group& group, std::optional<uint8_t> brightness, std::optional<uint32_t> temperature)
+{
+    if (group.gid == 0 && group.devices.isEmpty()) {
+        for (const auto& dev : location.devices) {
+            mMqtt->updateDeviceState(location.id, static_cast<uint8_t>(dev.did), brightness, temperature);
+        }
+    } else {
+        for (const auto did : group.devices) {
+            mMqtt->updateDeviceState(location.id, static_cast<uint8_t>(did), brightness, temperature);
+        }
+    }
+}
+
+void HaloManager::meshStateChanged(uint16_t destination, const LightState& state)
+{
+    const auto location = &static_cast<HaloBluetooth*>(sender())->location();
+    std::optional<uint32_t> temperature;
+    if (state.temperature.has_value()) {
+        temperature = state.temperature.value();
+    }
+
+    for (const auto& group : location->groups) {
+        if (groupAddress(group.gid) == destination) {
+            mMqtt->updateGroupState(location->id, group.gid, state.brightness, temperature);
+            updateGroupMembers(*location, group, state.brightness, temperature);
+            return;
+        }
+    }
     for (const auto& dev : location->devices) {
-        // mBluetooth->setBrightness(dev.did, 200);
-        // mBluetooth->setColorTemperature(dev.did, 5000);
-        mMqtt->publishDevice(location->id, dev);
-        mMqtt->publishDeviceState(location->id, dev.did, 255, 3333);
+        if (deviceAddress(dev.did) == destination) {
+            mMqtt->updateDeviceState(location->id, static_cast<uint8_t>(dev.did), state.brightness, temperature);
+            return;
+        }
     }
+    qDebug() << "state change for unknown destination" << destination;
 }
 
-void HaloManager::mqttStateRequested(uint32_t locationId, uint8_t deviceId, std::optional<uint8_t> brightness, std::optional<uint32_t> temperature)
+void HaloManager::mqttStateRequested(uint32_t locationId, uint8_t deviceId, std::optional<uint8_t> brightness, std::optional<uint32_t> temperature, qint64 ingress)
 {
-    Q_UNUSED(locationId);
-    if (brightness.has_value()) {
-        mBluetooth->setBrightness(deviceId, brightness.value());
+    auto bluetooth = this->bluetooth(locationId);
+    if (bluetooth == nullptr) {
+        qDebug() << "state for unknown location" << locationId;
+        return;
     }
-    if (temperature.has_value()) {
-        mBluetooth->setColorTemperature(deviceId, temperature.value());
+    bluetooth->setState(deviceAddress(deviceId), lightState(brightness, temperature), ingress);
+}
+
+void HaloManager::mqttGroupStateRequested(uint32_t locationId, uint32_t groupId, std::optional<uint8_t> brightness, std::optional<uint32_t> temperature, qint64 ingress)
+{
+    auto bluetooth = this->bluetooth(locationId);
+    if (bluetooth == nullptr) {
+        qDebug() << "group state for unknown location" << locationId;
+        return;
     }
+    const auto location = &bluetooth->location();
+    auto group = std::find_if(location->groups.cbegin(), location->groups.cend(),
+                              [groupId](const auto& other) {
+                                  return other.gid == groupId;
+                              });
+    if (group == location->groups.cend()) {
+        return;
+    }
+
+    // one burst for the whole group, the mesh fans it out
+    bluetooth->setState(groupAddress(groupId), lightState(brightness, temperature), ingress);
+
+    updateGroupMembers(*location, *group, brightness, temperature);
 }
 
 void HaloManager::mqttIdle()
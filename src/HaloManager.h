@@ -1,9 +1,14 @@
 #pragma once
 
+#include "AdvertRouter.h"
 #include "Options.h"
 #include "HaloMqtt.h"
+#include "MetricsServer.h"
 #include "HaloBluetooth.h"
+#include "BluetoothTransport.h"
+#include <QList>
 #include <QObject>
+#include <QSet>
 #include <cstdint>
 
 class HaloManager : public QObject
@@ -17,15 +22,27 @@ public:
 
 private slots:
     void bluetoothReady();
-    void bluetoothError(HaloBluetooth::Error error);
+    void bluetoothError(BluetoothTransport::Error error);
     void devicesReady();
     void mqttConnected();
-    void mqttStateRequested(uint32_t locationId, uint8_t deviceId, std::optional<uint8_t> brightness, std::optional<uint32_t> temperature);
+    void mqttStateRequested(uint32_t locationId, uint8_t deviceId, std::optional<uint8_t> brightness, std::optional<uint32_t> temperature, qint64 ingress);
+    void mqttGroupStateRequested(uint32_t locationId, uint32_t groupId, std::optional<uint8_t> brightness, std::optional<uint32_t> temperature, qint64 ingress);
     void mqttIdle();
+    void meshStateChanged(uint16_t destination, const LightState& state);
+
+private:
+    HaloBluetooth* bluetooth(uint32_t locationId) const;
+    void publishLocation(const HaloBluetooth* bluetooth);
+    void updateGroupMembers(const Location& location, const Group& group, std::optional<uint8_t> brightness, std::optional<uint32_t> temperature);
 
 private:
     Options mOptions;
-    HaloBluetooth* mBluetooth = nullptr;
+    BluetoothTransport* mTransport = nullptr;
+    // one pipeline per location, each with its own key, queue and pacing
+    QList<HaloBluetooth*> mBluetooths;
+    AdvertRouter mAdverts;
     HaloMqtt* mMqtt = nullptr;
-    bool mQuitting = false, mDevicesReady = false;
+    MetricsServer* mMetricsServer = nullptr;
+    QSet<uint32_t> mReadyLocations;
+    bool mQuitting = false;
 };
@@ -1,8 +1,10 @@
 #include "HaloMqtt.h"
-#include <QJsonDocument>
-#include <QJsonObject>
+#include "CommandParser.h"
+#include "Metrics.h"
 #include <QTimer>
 #include <QDebug>
+#include <algorithm>
+#include <limits>
 
 static const char* commandTopic = "halomqtt/light/command";
 static const char* stateTopic = "halomqtt/light/state";
@@ -12,10 +14,23 @@ HaloMqtt::HaloMqtt(const Options& options, QObject* parent)
     : QObject(parent), mOptions(options)
 {
     recreateClient();
+
+    mDebounceTimer.setSingleShot(true);
+    QObject::connect(&mDebounceTimer, &QTimer::timeout, this, &HaloMqtt::debounceExpired);
+
+    metrics::addCollector(this, [this](metrics::Writer& writer) {
+        writer.describe("halo_mqtt_connected", "gauge", "whether the mqtt client is connected");
+        writer.sample("halo_mqtt_connected").value(static_cast<uint64_t>(mConnected ? 1 : 0));
+        writer.describe("halo_mqtt_pending_publish", "gauge", "publishes waiting for the mqtt connection");
+        writer.sample("halo_mqtt_pending_publish").value(static_cast<uint64_t>(mPendingPublish.size()));
+        writer.describe("halo_mqtt_pending_sends", "gauge", "publishes in flight");
+        writer.sample("halo_mqtt_pending_sends").value(static_cast<uint64_t>(mPendingSends.size()));
+    });
 }
 
 HaloMqtt::~HaloMqtt()
 {
+    metrics::removeCollector(this);
     delete mClient;
 }
 
@@ -48,80 +63,125 @@ void HaloMqtt::connect()
     mClient->connectToHost();
 }
 
-void HaloMqtt::publishDevice(uint32_t locationId, const Device& device)
+static QByteArray deviceEntityId(uint32_t locationId, uint32_t deviceId)
 {
-    if (device.did >= mInfos.size()) {
-        mInfos.resize(device.did + 1);
-    }
+    return devicePrefix + QByteArray::number(locationId) + '_' + QByteArray::number(deviceId);
+}
 
-    const QByteArray baDeviceId = devicePrefix + QByteArray::number(locationId) + '_' + QByteArray::number(device.did);
-    const QByteArray discovery =
-    "{\"name\":\"" + device.name.toUtf8() + "\","
-    "\"command_topic\":\"" + QByteArray(commandTopic) + "/" + baDeviceId + "\","
-    "\"state_topic\":\"" + QByteArray(stateTopic) + "/" + baDeviceId + "\","
-    "\"object_id\":\"" + baDeviceId + "\","
-    "\"unique_id\":\"" + baDeviceId + "\","
-    "\"brightness\":true,"
-    "\"color_mode\":true,"
-    "\"supported_color_modes\":[\"color_temp\"],"
-    "\"max_mireds\":370,"
-    "\"min_mireds\":200,"
-    "\"schema\":\"json\"}";
+static QByteArray groupEntityId(uint32_t locationId, uint32_t groupId)
+{
+    return devicePrefix + QByteArray::number(locationId) + "_g" + QByteArray::number(groupId);
+}
+
+static uint64_t infoKey(uint32_t locationId, uint32_t id)
+{
+    return (static_cast<uint64_t>(locationId) << 32) | id;
+}
 
-    const QByteArray deviceTopic = "homeassistant/light/" + baDeviceId + "/config";
+void HaloMqtt::publish(const QByteArray& topic, const QByteArray& payload)
+{
     if (!mConnected) {
         qDebug() << "not connected";
-        mPendingPublish.append(std::make_pair(QString::fromUtf8(deviceTopic), discovery));
+        mPendingPublish.append(std::make_pair(QString::fromUtf8(topic), payload));
         return;
     }
 
-    auto id = mClient->publish(QString::fromUtf8(deviceTopic), discovery, 1, true);
+    auto id = mClient->publish(QString::fromUtf8(topic), payload, 1, true);
     mPendingSends.append(id);
 }
 
-void HaloMqtt::unpublishDevice(uint32_t locationId, uint8_t deviceId)
+void HaloMqtt::publishEntity(const QByteArray& entityId, const QString& name)
 {
-    const QByteArray baDeviceId = devicePrefix + QByteArray::number(locationId) + '_' + QByteArray::number(deviceId);
-    const QByteArray deviceTopic = "homeassistant/light/" + baDeviceId + "/config";
-    if (!mConnected) {
-        mPendingPublish.append(std::make_pair(QString::fromUtf8(deviceTopic), QByteArray()));
-        qDebug() << "not connected";
-        return;
-    }
+    const QByteArray discovery =
+    "{\"name\":\"" + name.toUtf8() + "\","
+    "\"command_topic\":\"" + QByteArray(commandTopic) + "/" + entityId + "\","
+    "\"state_topic\":\"" + QByteArray(stateTopic) + "/" + entityId + "\","
+    "\"object_id\":\"" + entityId + "\","
+    "\"unique_id\":\"" + entityId + "\","
+    "\"brightness\":true,"
+    "\"color_mode\":true,"
+    "\"supported_color_modes\":[\"color_temp\"],"
+    "\"max_mireds\":370,"
+    "\"min_mireds\":200,"
+    "\"schema\":\"json\"}";
 
-    auto id = mClient->publish(QString::fromUtf8(deviceTopic), QByteArray(), 1, true);
-    mPendingSends.append(id);
+    publish("homeassistant/light/" + entityId + "/config", discovery);
 }
 
-void HaloMqtt::publishDeviceState(uint32_t locationId, uint8_t deviceId, uint8_t brightness, uint32_t temperature)
+void HaloMqtt::publishEntityState(const QByteArray& entityId, uint8_t brightness, uint32_t temperature)
 {
-    const QByteArray baDeviceId = devicePrefix + QByteArray::number(locationId) + '_' + QByteArray::number(deviceId);
+    // the temperature is unknown until it has been set or seen on the mesh
+    const QByteArray colorTemp = temperature > 0
+        ? "\"color_temp\":" + QByteArray::number(static_cast<uint32_t>(1000000.f / temperature)) + ","
+        : QByteArray();
     const QByteArray state =
     "{\"state\":\"" + QByteArray(brightness > 0 ? "ON" : "OFF") + "\","
-    "\"color_temp\":" + QByteArray::number(static_cast<uint32_t>(1000000.f / temperature)) + ","
+    + colorTemp +
     "\"brightness\":" + QByteArray::number(brightness) + ","
     "\"color_mode\":\"color_temp\"}";
 
-    const QByteArray deviceTopic = QByteArray(stateTopic) + "/" + baDeviceId;
-
-    if (deviceId >= mInfos.size()) {
-        mInfos.resize(deviceId + 1);
+    if (mConnected) {
+        qDebug() << "publishing state" << entityId << state;
     }
-    mInfos[deviceId] = {
+    publish(QByteArray(stateTopic) + "/" + entityId, state);
+}
+
+void HaloMqtt::publishDevice(uint32_t locationId, const Device& device)
+{
+    mInfos[infoKey(locationId, device.did)];
+    publishEntity(deviceEntityId(locationId, device.did), device.name);
+}
+
+void HaloMqtt::unpublishDevice(uint32_t locationId, uint8_t deviceId)
+{
+    publish("homeassistant/light/" + deviceEntityId(locationId, deviceId) + "/config", QByteArray());
+}
+
+void HaloMqtt::publishDeviceState(uint32_t locationId, uint8_t deviceId, uint8_t brightness, uint32_t temperature)
+{
+    mInfos[infoKey(locationId, deviceId)] = {
         brightness,
         temperature
     };
+    publishEntityState(deviceEntityId(locationId, deviceId), brightness, temperature);
+}
 
-    if (!mConnected) {
-        qDebug() << "not connected";
-        mPendingPublish.append(std::make_pair(QString::fromUtf8(deviceTopic), state));
+void HaloMqtt::updateDeviceState(uint32_t locationId, uint8_t deviceId, std::optional<uint8_t> brightness, std::optional<uint32_t> temperature)
+{
+    const auto info = mInfos.constFind(infoKey(locationId, deviceId));
+    if (info == mInfos.cend()) {
         return;
     }
+    publishDeviceState(locationId, deviceId, brightness.value_or(info->brightness), temperature.value_or(info->colorTemp));
+}
 
-    qDebug() << "publishing device state" << locationId << deviceId << state;
+void HaloMqtt::publishGroup(uint32_t locationId, const Group& group)
+{
+    mGroupInfos[infoKey(locationId, group.gid)];
+    publishEntity(groupEntityId(locationId, group.gid), group.name);
+}
 
-    auto id = mClient->publish(QString::fromUtf8(deviceTopic), state, 1, true);
-    mPendingSends.append(id);
+void HaloMqtt::unpublishGroup(uint32_t locationId, uint32_t groupId)
+{
+    publish("homeassistant/light/" + groupEntityId(locationId, groupId) + "/config", QByteArray());
+}
+
+void HaloMqtt::publishGroupState(uint32_t locationId, uint32_t groupId, uint8_t brightness, uint32_t temperature)
+{
+    mGroupInfos[infoKey(locationId, groupId)] = {
+        brightness,
+        temperature
+    };
+    publishEntityState(groupEntityId(locationId, groupId), brightness, temperature);
+}
+
+void HaloMqtt::updateGroupState(uint32_t locationId, uint32_t groupId, std::optional<uint8_t> brightness, std::optional<uint32_t> temperature)
+{
+    const auto info = mGroupInfos.constFind(infoKey(locationId, groupId));
+    if (info == mGroupInfos.cend()) {
+        return;
+    }
+    publishGroupState(locationId, groupId, brightness.value_or(info->brightness), temperature.value_or(info->colorTemp));
 }
 
 void HaloMqtt::mqttConnected()
@@ -132,6 +192,7 @@ void HaloMqtt::mqttConnected()
     mSubscription = mClient->subscribe(QLatin1String(commandTopic) + "/+");
     QObject::connect(mSubscription, &QMqttSubscription::messageReceived, this, &HaloMqtt::mqttMessageReceived);
 
+    sendPendingPublishes();
     emit connected();
 }
 
@@ -169,6 +230,7 @@ void HaloMqtt::sendPendingPublishes()
 void HaloMqtt::reconnectNow()
 {
     qDebug() << "attempting to reconnect";
+    metrics::increment(metrics::Counter::MqttReconnects);
     recreateClient();
     mClient->connectToHost();
 }
@@ -194,80 +256,142 @@ void HaloMqtt::mqttErrorChanged(QMqttClient::ClientError error)
 
 void HaloMqtt::mqttMessageReceived(const QMqttMessage& message)
 {
-    auto doc = QJsonDocument::fromJson(message.payload());
-    if (doc.isObject()) {
-        // parse location and device ids from topic name
-        static const QByteArray baDeviceTopic = QByteArray(commandTopic) + "/" + devicePrefix;
-        const auto topic = message.topic().name().toUtf8();
-        if (!topic.startsWith(baDeviceTopic)) {
-            // not for us
-            return;
-        }
-
-        const auto underscore = topic.indexOf('_', baDeviceTopic.size());
-        if (underscore == -1) {
-            // nope
-            return;
-        }
+    const auto ingress = metrics::now();
+    // parse location and device ids from topic name
+    static const QByteArray baDeviceTopic = QByteArray(commandTopic) + "/" + devicePrefix;
+    commands::Target target;
+    if (!commands::parseTopic(message.topic().name(), baDeviceTopic, &target)) {
+        // not for us
+        return;
+    }
+    const auto payload = message.payload();
+    commands::Command command;
+    if (!commands::parsePayload(payload, &command)) {
+        qDebug() << "invalid command" << payload;
+        return;
+    }
 
-        const QByteArrayView locationView(topic.constData() + baDeviceTopic.size(), topic.constData() + underscore);
-        const QByteArrayView deviceView(topic.constData() + underscore + 1, topic.constData() + topic.size());
+    const bool isGroup = target.isGroup;
+    if (!isGroup && target.id > 255) {
+        qDebug() << "invalid id" << target.id;
+        return;
+    }
+    const auto key = infoKey(target.locationId, target.id);
+    if (isGroup && !mGroupInfos.contains(key)) {
+        qDebug() << "unknown group" << target.locationId << target.id;
+        return;
+    } else if (!isGroup && !mInfos.contains(key)) {
+        qDebug() << "unknown device" << target.locationId << target.id;
+        return;
+    }
 
-        bool ok;
-        const auto locationId = locationView.toInt(&ok);
-        if (!ok) {
-            // nope
-            return;
-        }
-        const auto deviceId = deviceView.toInt(&ok);
-        if (!ok) {
-            // nope
-            return;
-        }
+    const auto state = command.state;
+    auto brightness = command.brightness;
+    const auto colorTemp = command.temperature;
+    qDebug() << "mqtt message" << payload << "for" << target.locationId << (isGroup ? "group" : "device") << target.id;
 
-        if (locationId < 0) {
-            qDebug() << "unknown location" << locationId;
-            return;
-        }
+    auto& info = isGroup ? mGroupInfos[key] : mInfos[key];
+    if (state.value_or(false) && !brightness.has_value() && info.brightness == 0) {
+        brightness = 255;
+    } else if (state.has_value() && !state.value() && !brightness.has_value() && info.brightness > 0) {
+        brightness = 0;
+    }
 
-        if (deviceId < 0 || deviceId > 255 || deviceId >= mInfos.size()) {
-            qDebug() << "unknown device" << deviceId;
-            return;
-        }
+    if (brightness.has_value()) {
+        info.brightness = brightness.value();
+    }
+    if (colorTemp.has_value()) {
+        info.colorTemp = colorTemp.value();
+    }
+    debounce(isGroup, key, brightness, colorTemp, ingress);
+}
 
-        // qDebug() << "device" << locationId << deviceId;
+// The first command for an entity goes out right away and opens a window.
+// Commands arriving while it is open collapse into one that goes out when
+// it closes, which opens the next window, so a slider drag turns into one
+// command per window with the final value last.
+void HaloMqtt::debounce(bool isGroup, uint64_t key, std::optional<uint8_t> brightness, std::optional<uint32_t> colorTemp, qint64 ingress)
+{
+    if (mOptions.mqttDebounce == 0) {
+        requestState(isGroup, key, brightness, colorTemp, ingress);
+        return;
+    }
+    auto& windows = isGroup ? mGroupDebounce : mDebounce;
+    auto window = windows.find(key);
+    if (window == windows.end()) {
+        windows.insert(key, { ingress + static_cast<qint64>(mOptions.mqttDebounce) * 1000000, false, {}, {}, 0 });
+        requestState(isGroup, key, brightness, colorTemp, ingress);
+        scheduleDebounce();
+        return;
+    }
+    if (window->pending) {
+        metrics::increment(metrics::Counter::CommandsDebounced);
+    }
+    window->pending = true;
+    if (brightness.has_value()) {
+        window->brightness = brightness;
+    }
+    if (colorTemp.has_value()) {
+        window->colorTemp = colorTemp;
+    }
+    window->ingress = ingress;
+}
 
-        auto msgobj = doc.object();
-        std::optional<bool> state;
-        std::optional<uint8_t> brightness;
-        std::optional<uint32_t> colorTemp;
-        if (msgobj.contains("state")) {
-            state = msgobj.value("state").toString() == "ON";
-        }
-        if (msgobj.contains("brightness")) {
-            brightness = static_cast<uint8_t>(msgobj.value("brightness").toInt());
-        }
-        if (msgobj.contains("color_temp")) {
-            colorTemp = static_cast<uint32_t>(1000000.f / msgobj.value("color_temp").toDouble());
-        }
-        qDebug() << "mqtt message" << doc.toJson() << "for" << locationId << deviceId;
+void HaloMqtt::requestState(bool isGroup, uint64_t key, std::optional<uint8_t> brightness, std::optional<uint32_t> colorTemp, qint64 ingress)
+{
+    const auto locationId = static_cast<uint32_t>(key >> 32);
+    const auto id = static_cast<uint32_t>(key);
+    if (isGroup) {
+        const auto& info = mGroupInfos[key];
+        publishGroupState(locationId, id, info.brightness, info.colorTemp);
+        metrics::recordStage(metrics::Stage::Parsed, locationId, groupAddress(id), ingress);
+        emit groupStateRequested(locationId, id, brightness, colorTemp, ingress);
+        return;
+    }
+    const auto& info = mInfos[key];
+    publishDeviceState(locationId, static_cast<uint8_t>(id), info.brightness, info.colorTemp);
+    metrics::recordStage(metrics::Stage::Parsed, locationId, deviceAddress(id), ingress);
+    emit stateRequested(locationId, static_cast<uint8_t>(id), brightness, colorTemp, ingress);
+}
 
-        auto& info = mInfos[deviceId];
-        if (state.value_or(false) && !brightness.has_value() && info.brightness == 0) {
-            brightness = 255;
-        } else if (state.has_value() && !state.value() && !brightness.has_value() && info.brightness > 0) {
-            brightness = 0;
+void HaloMqtt::debounceExpired()
+{
+    const auto now = metrics::now();
+    const auto window = static_cast<qint64>(mOptions.mqttDebounce) * 1000000;
+    for (const bool isGroup : { false, true }) {
+        auto& windows = isGroup ? mGroupDebounce : mDebounce;
+        for (auto it = windows.begin(); it != windows.end();) {
+            if (it->windowEnd > now) {
+                ++it;
+            } else if (it->pending) {
+                const auto pending = *it;
+                *it = { now + window, false, {}, {}, 0 };
+                requestState(isGroup, it.key(), pending.brightness, pending.colorTemp, pending.ingress);
+                ++it;
+            } else {
+                it = windows.erase(it);
+            }
         }
+    }
+    scheduleDebounce();
+}
 
-        if (brightness.has_value()) {
-            info.brightness = brightness.value();
-        }
-        if (colorTemp.has_value()) {
-            info.colorTemp = colorTemp.value();
-        }
-        publishDeviceState(static_cast<uint32_t>(locationId), static_cast<uint8_t>(deviceId), info.brightness, info.colorTemp);
-        emit stateRequested(static_cast<uint32_t>(locationId), static_cast<uint8_t>(deviceId), brightness, colorTemp);
+void HaloMqtt::scheduleDebounce()
+{
+    qint64 next = std::numeric_limits<qint64>::max();
+    for (const auto& window : mDebounce) {
+        next = std::min(next, window.windowEnd);
+    }
+    for (const auto& window : mGroupDebounce) {
+        next = std::min(next, window.windowEnd);
+    }
+    if (next == std::numeric_limits<qint64>::max()) {
+        mDebounceTimer.stop();
+        return;
     }
+    // round up so the timer never fires just before the window closes
+    const auto remaining = (std::max<qint64>(next - metrics::now(), 0) + 999999) / 1000000;
+    mDebounceTimer.start(static_cast<int>(remaining));
 }
 
 #include "moc_HaloMqtt.cpp"
@@ -6,8 +6,10 @@
 #include <QMqttClient>
 #include <QMqttMessage>
 #include <QMqttSubscription>
+#include <QHash>
 #include <QList>
 #include <QString>
+#include <QTimer>
 #include <cstdint>
 #include <optional>
 
@@ -24,10 +26,18 @@ public:
     void publishDevice(uint32_t locationId, const Device& device);
     void unpublishDevice(uint32_t locationId, uint8_t deviceId);
     void publishDeviceState(uint32_t locationId, uint8_t deviceId, uint8_t brightness, uint32_t temperature);
+    // merges into the last known state, i.e. for the members of a group
+    void updateDeviceState(uint32_t locationId, uint8_t deviceId, std::optional<uint8_t> brightness, std::optional<uint32_t> temperature);
+
+    void publishGroup(uint32_t locationId, const Group& group);
+    void unpublishGroup(uint32_t locationId, uint32_t groupId);
+    void publishGroupState(uint32_t locationId, uint32_t groupId, uint8_t brightness, uint32_t temperature);
+    void updateGroupState(uint32_t locationId, uint32_t groupId, std::optional<uint8_t> brightness, std::optional<uint32_t> temperature);
 
 signals:
     void idle();
-    void stateRequested(uint32_t locationId, uint8_t deviceId, std::optional<uint8_t> brightness, std::optional<uint32_t> temperature);
+    void stateRequested(uint32_t locationId, uint8_t deviceId, std::optional<uint8_t> brightness, std::optional<uint32_t> temperature, qint64 ingress);
+    void groupStateRequested(uint32_t locationId, uint32_t groupId, std::optional<uint8_t> brightness, std::optional<uint32_t> temperature, qint64 ingress);
     void connected();
 
 private slots:
@@ -37,10 +47,7 @@ private slots:
     void mqttErrorChanged(QMqttClient::ClientError error);
     void mqttMessageSent(qint32 id);
     void reconnectNow();
-
-private:
-    void recreateClient();
-    void sendPendingPublishes();
+    void debounceExpired();
 
 private:
     struct DeviceInfo
@@ -49,10 +56,36 @@ private:
         uint32_t colorTemp = 0;
     };
 
+    // a command that arrived while the entity's debounce window was open,
+    // later values replace earlier ones
+    struct Debounce
+    {
+        qint64 windowEnd = 0;
+        bool pending = false;
+        std::optional<uint8_t> brightness;
+        std::optional<uint32_t> colorTemp;
+        qint64 ingress = 0;
+    };
+
+    void recreateClient();
+    void sendPendingPublishes();
+    void publish(const QByteArray& topic, const QByteArray& payload);
+    void publishEntity(const QByteArray& entityId, const QString& name);
+    void publishEntityState(const QByteArray& entityId, uint8_t brightness, uint32_t temperature);
+    void debounce(bool isGroup, uint64_t key, std::optional<uint8_t> brightness, std::optional<uint32_t> colorTemp, qint64 ingress);
+    void requestState(bool isGroup, uint64_t key, std::optional<uint8_t> brightness, std::optional<uint32_t> colorTemp, qint64 ingress);
+    void scheduleDebounce();
+
     Options mOptions;
     QMqttClient* mClient = nullptr;
     QMqttSubscription* mSubscription = nullptr;
-    QList<DeviceInfo> mInfos;
+    // keyed by location and device or group id, see infoKey()
+    QHash<uint64_t, DeviceInfo> mInfos;
+    QHash<uint64_t, DeviceInfo> mGroupInfos;
+    // open debounce windows, same keys as the infos
+    QHash<uint64_t, Debounce> mDebounce;
+    QHash<uint64_t, Debounce> mGroupDebounce;
+    QTimer mDebounceTimer;
     QList<std::pair<QString, QByteArray>> mPendingPublish;
     QList<qint32> mPendingSends;
     bool mConnected = false;
@@ -53,6 +53,32 @@ Locations locationsFromFile(const QString& file)
                                 location.devices.append(std::move(device));
                             }
                         }
+                    } else if (jsonLocationKey == "groups" && jsonLocationValue.isArray()) {
+                        const auto jsonGroups = jsonLocationValue.toArray();
+                        for (const auto& jsonGroup : jsonGroups) {
+                            if (jsonGroup.isObject()) {
+                                Group group = {};
+                                const auto& jsonGroupObject = jsonGroup.toObject();
+                                for (auto jsonGroupIt = jsonGroupObject.begin(), jsonGroupEnd = jsonGroupObject.end();
+                                     jsonGroupIt != jsonGroupEnd; ++jsonGroupIt) {
+                                    const auto& jsonGroupKey = jsonGroupIt.key();
+                                    const auto& jsonGroupValue = jsonGroupIt.value();
+                                    if (jsonGroupKey == "gid" && jsonGroupValue.isDouble()) {
+                                        group.gid = static_cast<uint32_t>(jsonGroupValue.toInteger());
+                                    } else if (jsonGroupKey == "name" && jsonGroupValue.isString()) {
+                                        group.name = jsonGroupValue.toString();
+                                    } else if (jsonGroupKey == "devices" && jsonGroupValue.isArray()) {
+                                        const auto jsonGroupDevices = jsonGroupValue.toArray();
+                                        for (const auto& jsonGroupDevice : jsonGroupDevices) {
+                                            if (jsonGroupDevice.isDouble()) {
+                                                group.devices.append(static_cast<uint32_t>(jsonGroupDevice.toInteger()));
+                                            }
+                                        }
+                                    }
+                                }
+                                location.groups.append(std::move(group));
+                            }
+                        }
                     }
                 }
                 locations.append(std::move(location));
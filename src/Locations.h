@@ -12,14 +12,34 @@ struct Device
     QString pid = {};
 };
 
+// a gid of 0 is the whole mesh, an empty device list then means every device
+struct Group
+{
+    uint32_t gid = 0;
+    QString name = {};
+    QList<uint32_t> devices = {};
+};
+
 struct Location
 {
     uint32_t id = 0;
     QString name = {};
     QString passphrase = {};
     QList<Device> devices = {};
+    QList<Group> groups = {};
 };
 
+// csrmesh destination addresses, groups share the id space of devices
+inline uint16_t deviceAddress(uint32_t did)
+{
+    return static_cast<uint16_t>(0x8080 + did);
+}
+
+inline uint16_t groupAddress(uint32_t gid)
+{
+    return gid == 0 ? 0 : static_cast<uint16_t>(0x8080 + gid);
+}
+
 using Locations = QList<Location>;
 
 Locations locationsFromFile(const QString& file);
@@ -0,0 +1,381 @@
+#include "Metrics.h"
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QHash>
+#include <algorithm>
+#include <charconv>
+
+namespace metrics {
+
+static QElapsedTimer startTimer()
+{
+    QElapsedTimer timer;
+    timer.start();
+    return timer;
+}
+
+static const QElapsedTimer monotonic = startTimer();
+
+qint64 now()
+{
+    return monotonic.nsecsElapsed();
+}
+
+const qint64 Histogram::bucketBounds[BucketCount - 1] = {
+    100, 250, 500,
+    1000, 2500, 5000,
+    10000, 25000, 50000,
+    100000, 250000, 500000,
+    1000000, 2500000, 5000000,
+    10000000, 30000000
+};
+
+// the bounds above in seconds, for prometheus
+static const char* bucketLabels[Histogram::BucketCount - 1] = {
+    "0.0001", "0.00025", "0.0005",
+    "0.001", "0.0025", "0.005",
+    "0.01", "0.025", "0.05",
+    "0.1", "0.25", "0.5",
+    "1", "2.5", "5",
+    "10", "30"
+};
+
+void Histogram::record(qint64 nsecs)
+{
+    const qint64 usecs = nsecs / 1000;
+    const auto bound = std::lower_bound(bucketBounds, bucketBounds + BucketCount - 1, usecs);
+    mBuckets[bound - bucketBounds].fetch_add(1, std::memory_order_relaxed);
+    mCount.fetch_add(1, std::memory_order_relaxed);
+    mSum.fetch_add(static_cast<uint64_t>(nsecs), std::memory_order_relaxed);
+}
+
+uint64_t Histogram::count() const
+{
+    return mCount.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::sum() const
+{
+    return mSum.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::bucket(int idx) const
+{
+    return mBuckets[idx].load(std::memory_order_relaxed);
+}
+
+qint64 Histogram::percentile(double p) const
+{
+    uint64_t total = 0;
+    for (int i = 0; i < BucketCount; ++i) {
+        total += bucket(i);
+    }
+    if (total == 0) {
+        return 0;
+    }
+    const auto target = static_cast<uint64_t>(p * static_cast<double>(total));
+    uint64_t seen = 0;
+    for (int i = 0; i < BucketCount - 1; ++i) {
+        seen += bucket(i);
+        if (seen > target) {
+            return bucketBounds[i];
+        }
+    }
+    return bucketBounds[BucketCount - 2];
+}
+
+struct StageHistograms
+{
+    Histogram stages[StageCount];
+};
+
+static StageHistograms totals;
+// only ever added to, from the main thread
+static QHash<Destination, StageHistograms*> devices;
+
+const char* stageName(Stage stage)
+{
+    switch (stage) {
+    case Stage::Parsed:
+        return "parsed";
+    case Stage::Enqueued:
+        return "enqueued";
+    case Stage::Encrypted:
+        return "encrypted";
+    case Stage::Written:
+        return "written";
+    }
+    return "unknown";
+}
+
+void recordStage(Stage stage, uint32_t locationId, uint32_t destination, qint64 ingress)
+{
+    if (ingress == 0) {
+        return;
+    }
+    const auto elapsed = now() - ingress;
+    totals.stages[static_cast<int>(stage)].record(elapsed);
+
+    auto& device = devices[{ locationId, destination }];
+    if (device == nullptr) {
+        device = new StageHistograms;
+    }
+    device->stages[static_cast<int>(stage)].record(elapsed);
+}
+
+const Histogram& stageHistogram(Stage stage)
+{
+    return totals.stages[static_cast<int>(stage)];
+}
+
+const Histogram* deviceHistogram(Stage stage, uint32_t locationId, uint32_t destination)
+{
+    const auto device = devices.value({ locationId, destination });
+    if (device == nullptr) {
+        return nullptr;
+    }
+    return &device->stages[static_cast<int>(stage)];
+}
+
+QList<Destination> latencyDevices()
+{
+    auto ids = devices.keys();
+    std::sort(ids.begin(), ids.end());
+    return ids;
+}
+
+static void logHistogram(const QByteArray& name, Stage stage, const Histogram& histogram)
+{
+    if (histogram.count() == 0) {
+        return;
+    }
+    qDebug().nospace().noquote() << name << " " << stageName(stage)
+                       << ": count " << histogram.count()
+                       << " p50 " << histogram.percentile(0.50) << "us"
+                       << " p95 " << histogram.percentile(0.95) << "us"
+                       << " p99 " << histogram.percentile(0.99) << "us";
+}
+
+void logLatencies()
+{
+    for (int stage = 0; stage < StageCount; ++stage) {
+        logHistogram("all", static_cast<Stage>(stage), totals.stages[stage]);
+    }
+    for (const auto& device : latencyDevices()) {
+        const auto name = "location " + QByteArray::number(device.first) + " destination " + QByteArray::number(device.second, 16);
+        for (int stage = 0; stage < StageCount; ++stage) {
+            logHistogram(name, static_cast<Stage>(stage), devices.value(device)->stages[stage]);
+        }
+    }
+}
+
+static std::atomic<uint64_t> counters[CounterCount] = {};
+
+static const char* counterName(Counter counter)
+{
+    switch (counter) {
+    case Counter::PacketsEncrypted:
+        return "halo_packets_encrypted_total";
+    case Counter::MqttReconnects:
+        return "halo_mqtt_reconnects_total";
+    case Counter::WriteFailures:
+        return "halo_write_failures_total";
+    case Counter::WritesSuppressed:
+        return "halo_writes_suppressed_total";
+    case Counter::AdvertsSeen:
+        return "halo_adverts_seen_total";
+    case Counter::AdvertsFiltered:
+        return "halo_adverts_filtered_total";
+    case Counter::AdvertsAccepted:
+        return "halo_adverts_accepted_total";
+    case Counter::CommandsDebounced:
+        return "halo_mqtt_commands_debounced_total";
+    }
+    return "halo_unknown_total";
+}
+
+static const char* counterHelp(Counter counter)
+{
+    switch (counter) {
+    case Counter::PacketsEncrypted:
+        return "csrmesh packets encrypted for writing";
+    case Counter::MqttReconnects:
+        return "times the mqtt client reconnected to the broker";
+    case Counter::WriteFailures:
+        return "bluetooth writes that failed";
+    case Counter::WritesSuppressed:
+        return "commands dropped because the light already had that state";
+    case Counter::AdvertsSeen:
+        return "bluetooth adverts received from the scanner";
+    case Counter::AdvertsFiltered:
+        return "adverts dropped because the device isn't in any location";
+    case Counter::AdvertsAccepted:
+        return "adverts from devices in a location";
+    case Counter::CommandsDebounced:
+        return "mqtt commands replaced by a newer command for the same light";
+    }
+    return "unknown";
+}
+
+void increment(Counter counter, uint64_t amount)
+{
+    counters[static_cast<int>(counter)].fetch_add(amount, std::memory_order_relaxed);
+}
+
+uint64_t counter(Counter counter)
+{
+    return counters[static_cast<int>(counter)].load(std::memory_order_relaxed);
+}
+
+Writer::Writer(QByteArray& out)
+    : mOut(out)
+{
+}
+
+void Writer::describe(const char* name, const char* type, const char* help)
+{
+    mOut.append("# HELP ").append(name).append(' ').append(help).append('\n');
+    mOut.append("# TYPE ").append(name).append(' ').append(type).append('\n');
+}
+
+Writer& Writer::sample(const char* name)
+{
+    mOut.append(name);
+    mInLabels = false;
+    return *this;
+}
+
+Writer& Writer::label(const char* key, QByteArrayView value)
+{
+    mOut.append(mInLabels ? ',' : '{');
+    mInLabels = true;
+    mOut.append(key).append("=\"").append(value).append('"');
+    return *this;
+}
+
+Writer& Writer::label(const char* key, uint64_t value)
+{
+    mOut.append(mInLabels ? ',' : '{');
+    mInLabels = true;
+    mOut.append(key).append("=\"");
+    appendNumber(value);
+    mOut.append('"');
+    return *this;
+}
+
+void Writer::endLabels()
+{
+    if (mInLabels) {
+        mOut.append('}');
+        mInLabels = false;
+    }
+    mOut.append(' ');
+}
+
+void Writer::value(uint64_t value)
+{
+    endLabels();
+    appendNumber(value);
+    mOut.append('\n');
+}
+
+void Writer::value(double value)
+{
+    endLabels();
+    appendNumber(value);
+    mOut.append('\n');
+}
+
+void Writer::appendNumber(uint64_t value)
+{
+    char buf[24];
+    const auto result = std::to_chars(buf, buf + sizeof(buf), value);
+    mOut.append(buf, result.ptr - buf);
+}
+
+void Writer::appendNumber(double value)
+{
+    char buf[32];
+    const auto result = std::to_chars(buf, buf + sizeof(buf), value);
+    mOut.append(buf, result.ptr - buf);
+}
+
+static QList<std::pair<const void*, Collector>> collectors;
+
+void addCollector(const void* owner, Collector&& collector)
+{
+    collectors.append(std::make_pair(owner, std::move(collector)));
+}
+
+void removeCollector(const void* owner)
+{
+    collectors.removeIf([owner](const auto& collector) {
+        return collector.first == owner;
+    });
+}
+
+static void renderHistogram(Writer& writer, const char* name, Stage stage, const Histogram& histogram)
+{
+    uint64_t cumulative = 0;
+    for (int i = 0; i < Histogram::BucketCount - 1; ++i) {
+        cumulative += histogram.bucket(i);
+        writer.sample(name).label("stage", stageName(stage)).label("le", QByteArrayView(bucketLabels[i])).value(cumulative);
+    }
+    cumulative += histogram.bucket(Histogram::BucketCount - 1);
+    writer.sample(name).label("stage", stageName(stage)).label("le", "+Inf").value(cumulative);
+}
+
+void render(QByteArray& out)
+{
+    Writer writer(out);
+
+    for (int i = 0; i < CounterCount; ++i) {
+        const auto name = counterName(static_cast<Counter>(i));
+        writer.describe(name, "counter", counterHelp(static_cast<Counter>(i)));
+        writer.sample(name).value(counter(static_cast<Counter>(i)));
+    }
+
+    writer.describe("halo_command_latency_seconds", "histogram", "latency from mqtt ingress to each command stage");
+    for (int stage = 0; stage < StageCount; ++stage) {
+        const auto& histogram = totals.stages[stage];
+        renderHistogram(writer, "halo_command_latency_seconds_bucket", static_cast<Stage>(stage), histogram);
+        writer.sample("halo_command_latency_seconds_sum").label("stage", stageName(static_cast<Stage>(stage))).value(static_cast<double>(histogram.sum()) / 1e9);
+        writer.sample("halo_command_latency_seconds_count").label("stage", stageName(static_cast<Stage>(stage))).value(histogram.count());
+    }
+
+    // a summary, the quantiles are bucket bounds from the fixed histogram
+    writer.describe("halo_device_command_latency_seconds", "summary", "per location and destination latency from mqtt ingress to each command stage");
+    for (auto it = devices.cbegin(), end = devices.cend(); it != end; ++it) {
+        for (int stage = 0; stage < StageCount; ++stage) {
+            const auto& histogram = it.value()->stages[stage];
+            if (histogram.count() == 0) {
+                continue;
+            }
+            static const std::pair<const char*, double> quantiles[] = { { "0.5", 0.50 }, { "0.95", 0.95 }, { "0.99", 0.99 } };
+            for (const auto& quantile : quantiles) {
+                writer.sample("halo_device_command_latency_seconds")
+                    .label("location", it.key().first)
+                    .label("destination", it.key().second)
+                    .label("stage", stageName(static_cast<Stage>(stage)))
+                    .label("quantile", quantile.first)
+                    .value(static_cast<double>(histogram.percentile(quantile.second)) / 1e6);
+            }
+            writer.sample("halo_device_command_latency_seconds_sum")
+                .label("location", it.key().first)
+                .label("destination", it.key().second)
+                .label("stage", stageName(static_cast<Stage>(stage)))
+                .value(static_cast<double>(histogram.sum()) / 1e9);
+            writer.sample("halo_device_command_latency_seconds_count")
+                .label("location", it.key().first)
+                .label("destination", it.key().second)
+                .label("stage", stageName(static_cast<Stage>(stage)))
+                .value(histogram.count());
+        }
+    }
+
+    for (const auto& collector : collectors) {
+        collector.second(writer);
+    }
+}
+
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <QByteArray>
+#include <QByteArrayView>
+#include <QList>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <utility>
+
+namespace metrics {
+
+// monotonic clock in nanoseconds
+qint64 now();
+
+// Fixed bucket latency histogram. Buckets are plain relaxed atomics so it can
+// be read at any time without locking.
+class Histogram
+{
+public:
+    enum { BucketCount = 18 };
+    // upper bounds in microseconds, the last bucket is unbounded
+    static const qint64 bucketBounds[BucketCount - 1];
+
+    void record(qint64 nsecs);
+
+    uint64_t count() const;
+    uint64_t sum() const;
+    uint64_t bucket(int idx) const;
+    // upper bound in microseconds of the bucket holding the percentile
+    qint64 percentile(double p) const;
+
+private:
+    std::atomic<uint64_t> mBuckets[BucketCount] = {};
+    std::atomic<uint64_t> mCount { 0 }, mSum { 0 };
+};
+
+// command stages, each measured from mqtt ingress and kept per location and
+// csrmesh destination address
+enum class Stage { Parsed, Enqueued, Encrypted, Written };
+enum { StageCount = 4 };
+
+// a location id and a destination address in it
+using Destination = std::pair<uint32_t, uint32_t>;
+
+const char* stageName(Stage stage);
+void recordStage(Stage stage, uint32_t locationId, uint32_t destination, qint64 ingress);
+const Histogram& stageHistogram(Stage stage);
+const Histogram* deviceHistogram(Stage stage, uint32_t locationId, uint32_t destination);
+QList<Destination> latencyDevices();
+
+void logLatencies();
+
+enum class Counter {
+    PacketsEncrypted,
+    MqttReconnects,
+    WriteFailures,
+    WritesSuppressed,
+    AdvertsSeen,
+    AdvertsFiltered,
+    AdvertsAccepted,
+    CommandsDebounced
+};
+enum { CounterCount = 8 };
+
+void increment(Counter counter, uint64_t amount = 1);
+uint64_t counter(Counter counter);
+
+// Appends prometheus text format straight into a reused buffer, without
+// building any intermediate strings
+class Writer
+{
+public:
+    Writer(QByteArray& out);
+
+    void describe(const char* name, const char* type, const char* help);
+    Writer& sample(const char* name);
+    Writer& label(const char* key, QByteArrayView value);
+    Writer& label(const char* key, uint64_t value);
+    void value(uint64_t value);
+    void value(double value);
+
+private:
+    void appendNumber(uint64_t value);
+    void appendNumber(double value);
+    void endLabels();
+
+    QByteArray& mOut;
+    bool mInLabels = false;
+};
+
+// collectors add their own samples every time the metrics are rendered
+using Collector = std::function<void(Writer&)>;
+void addCollector(const void* owner, Collector&& collector);
+void removeCollector(const void* owner);
+
+void render(QByteArray& out);
+
+}
@@ -0,0 +1,89 @@
+#include "MetricsServer.h"
+#include "Metrics.h"
+#include <QTcpSocket>
+#include <QDebug>
+
+static const int lagInterval = 1000;
+// scrapers that connect and never send a request get dropped after this
+static const int idleTimeout = 10000;
+
+MetricsServer::MetricsServer(uint16_t port, QObject* parent)
+    : QObject(parent)
+{
+    mServer = new QTcpServer(this);
+    QObject::connect(mServer, &QTcpServer::newConnection, this, &MetricsServer::newConnection);
+    if (!mServer->listen(QHostAddress::Any, port)) {
+        qDebug() << "unable to listen for metrics on port" << port << mServer->errorString();
+    } else {
+        qDebug() << "serving metrics on port" << port;
+    }
+
+    // event loop lag is how late a precise timer fires
+    mLagTimer.setTimerType(Qt::PreciseTimer);
+    mLagTimer.setInterval(lagInterval);
+    QObject::connect(&mLagTimer, &QTimer::timeout, this, &MetricsServer::checkLag);
+    mLastTick = metrics::now();
+    mLagTimer.start();
+
+    metrics::addCollector(this, [this](metrics::Writer& writer) {
+        writer.describe("halo_event_loop_lag_seconds", "gauge", "how late the last event loop tick was");
+        writer.sample("halo_event_loop_lag_seconds").value(static_cast<double>(mLag) / 1e9);
+        writer.describe("halo_event_loop_lag_max_seconds", "gauge", "the largest event loop lag seen");
+        writer.sample("halo_event_loop_lag_max_seconds").value(static_cast<double>(mMaxLag) / 1e9);
+    });
+}
+
+MetricsServer::~MetricsServer()
+{
+    metrics::removeCollector(this);
+}
+
+void MetricsServer::checkLag()
+{
+    const auto tick = metrics::now();
+    mLag = std::max<qint64>(0, tick - mLastTick - lagInterval * 1000000ll);
+    mMaxLag = std::max(mMaxLag, mLag);
+    mLastTick = tick;
+}
+
+void MetricsServer::newConnection()
+{
+    while (mServer->hasPendingConnections()) {
+        auto socket = mServer->nextPendingConnection();
+        QObject::connect(socket, &QTcpSocket::disconnected, socket, &QObject::deleteLater);
+        QTimer::singleShot(idleTimeout, socket, [socket]() {
+            socket->abort();
+            socket->deleteLater();
+        });
+        QObject::connect(socket, &QTcpSocket::readyRead, this, [this, socket]() {
+            if (!socket->canReadLine()) {
+                return;
+            }
+            const auto request = socket->readLine();
+            // one response per connection, anything sent after the request
+            // line is ignored until the socket closes
+            QObject::disconnect(socket, &QTcpSocket::readyRead, this, nullptr);
+            // we don't care about the headers
+            socket->readAll();
+
+            if (!request.startsWith("GET /metrics ") && !request.startsWith("GET / ")) {
+                socket->write("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+                socket->disconnectFromHost();
+                return;
+            }
+
+            // resize rather than clear so both buffers keep their capacity between scrapes
+            mBody.resize(0);
+            metrics::render(mBody);
+            mResponse.resize(0);
+            mResponse.append("HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\nContent-Length: ");
+            mResponse.append(QByteArray::number(mBody.size()));
+            mResponse.append("\r\n\r\n");
+            mResponse.append(mBody);
+            socket->write(mResponse);
+            socket->disconnectFromHost();
+        });
+    }
+}
+
+#include "moc_MetricsServer.cpp"
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <QObject>
+#include <QByteArray>
+#include <QTcpServer>
+#include <QTimer>
+#include <cstdint>
+
+// Serves metrics::render() over http for prometheus to scrape
+class MetricsServer : public QObject
+{
+    Q_OBJECT
+public:
+    MetricsServer(uint16_t port, QObject* parent = nullptr);
+    ~MetricsServer();
+
+private slots:
+    void newConnection();
+    void checkLag();
+
+private:
+    QTcpServer* mServer = nullptr;
+    QTimer mLagTimer;
+    qint64 mLastTick = 0, mLag = 0, mMaxLag = 0;
+    QByteArray mBody, mResponse;
+};
@@ -7,9 +7,29 @@ struct Options
 {
     QString locations;
     QString devices;
+    QString stateDir;
     QString mqttUser;
     QString mqttPassword;
     QString mqttHost;
     uint16_t mqttPort;
+    uint32_t mqttDebounce;
     uint32_t deviceDelay;
+    uint32_t minDeviceDelay;
+    uint32_t gateways;
+    uint32_t maxConnects;
+    uint32_t connectTimeout;
+    QString adapters;
+    double lowLatencyInterval;
+    double powerSavingInterval;
+    bool connectionProfiles;
+    bool partialWrites;
+    uint32_t stateRefresh;
+    uint16_t metricsPort;
+    bool simulate;
+    uint32_t simulateConnectLatency;
+    uint32_t simulateWriteLatency;
+    double simulateDropRate;
+    double simulateDisconnectRate;
+    uint32_t simulateSwitchInterval;
+    uint32_t simulateAdverts;
 };
@@ -0,0 +1,60 @@
+#include "PacketBuilder.h"
+
+PacketBuilder::PacketBuilder(qsizetype poolSize)
+{
+    mRing.resize(poolSize);
+}
+
+void PacketBuilder::setKey(const QByteArray& key)
+{
+    mEncoder.setKey(key);
+    mHasKey = true;
+    // anything precomputed was for the old key
+    mHead = mCount = 0;
+}
+
+void PacketBuilder::setSequenceFunction(SequenceFunction&& func)
+{
+    mSequenceFunction = std::move(func);
+}
+
+void PacketBuilder::computeKeystream(uint32_t seq, Keystream& keystream) const
+{
+    keystream.seq = seq;
+    mEncoder.keystream(seq, keystream.block);
+}
+
+void PacketBuilder::refill()
+{
+    if (!mSequenceFunction || !mHasKey) {
+        return;
+    }
+    while (mCount < mRing.size()) {
+        computeKeystream(mSequenceFunction(), mRing[(mHead + mCount) % mRing.size()]);
+        ++mCount;
+    }
+}
+
+QByteArray PacketBuilder::makePacket(const QByteArray& data)
+{
+    uint8_t out[crypto::PacketEncoder::MaxPacketSize];
+    const auto size = makePacket(data, out);
+    if (size < 0) {
+        return {};
+    }
+    return QByteArray(reinterpret_cast<const char*>(out), size);
+}
+
+qsizetype PacketBuilder::makePacket(QByteArrayView data, uint8_t (&out)[crypto::PacketEncoder::MaxPacketSize])
+{
+    Keystream keystream;
+    if (mCount > 0) {
+        keystream = mRing[mHead];
+        mHead = (mHead + 1) % mRing.size();
+        --mCount;
+    } else {
+        // ran dry, compute on the critical path
+        computeKeystream(mSequenceFunction(), keystream);
+    }
+    return mEncoder.encode(keystream.seq, keystream.block, data, out);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "Crypto.h"
+#include <QByteArray>
+#include <QList>
+#include <cstdint>
+#include <functional>
+
+// Builds CSRmesh packets for one location. The AES key schedule is expanded
+// once per key and the OFB keystream only depends on the key and the IV
+// (sequence number and source), so the keystream for upcoming sequence
+// numbers is precomputed into a ring. Building a packet then only needs the
+// xor, the hmac and the framing, which crypto::PacketEncoder does without
+// allocating.
+class PacketBuilder
+{
+public:
+    using SequenceFunction = std::function<uint32_t()>;
+
+    PacketBuilder(qsizetype poolSize = 64);
+
+    void setKey(const QByteArray& key);
+    void setSequenceFunction(SequenceFunction&& func);
+
+    QByteArray makePacket(const QByteArray& data);
+    qsizetype makePacket(QByteArrayView data, uint8_t (&out)[crypto::PacketEncoder::MaxPacketSize]);
+
+    qsizetype available() const;
+    bool isFull() const;
+    void refill();
+
+private:
+    struct Keystream
+    {
+        uint32_t seq = 0;
+        uint8_t block[16] = {};
+    };
+
+    void computeKeystream(uint32_t seq, Keystream& keystream) const;
+
+private:
+    crypto::PacketEncoder mEncoder;
+    bool mHasKey = false;
+    SequenceFunction mSequenceFunction;
+    QList<Keystream> mRing;
+    qsizetype mHead = 0, mCount = 0;
+};
+
+inline qsizetype PacketBuilder::available() const
+{
+    return mCount;
+}
+
+inline bool PacketBuilder::isFull() const
+{
+    return mCount == mRing.size();
+}
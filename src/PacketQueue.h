@@ -0,0 +1,87 @@
+#pragma once
+
+#include <QByteArray>
+#include <QList>
+#include <cstdint>
+
+// Pending mesh packets keyed by destination and attribute. A newer packet
+// for the same key replaces the queued one so only the latest intent per
+// light goes on air and the queue never grows beyond the number of
+// distinct targets.
+class PacketQueue
+{
+public:
+    enum class Attribute : uint8_t { Brightness, ColorTemperature };
+
+    struct Packet
+    {
+        uint32_t destination = 0;
+        Attribute attribute = Attribute::Brightness;
+        QByteArray data = {};
+        // mqtt ingress time of the command, see metrics::now()
+        qint64 ingress = 0;
+    };
+
+    bool isEmpty() const;
+    qsizetype size() const;
+
+    void enqueue(const Packet& packet);
+    // drops the queued packet for the same destination and attribute
+    void discard(const Packet& packet);
+    // the packets at the front that share a destination, i.e. the attributes
+    // of one command
+    QList<Packet> takeBurst();
+    QList<Packet> takeAll();
+    void clear();
+
+private:
+    QList<Packet> mPackets;
+};
+
+inline bool PacketQueue::isEmpty() const
+{
+    return mPackets.isEmpty();
+}
+
+inline qsizetype PacketQueue::size() const
+{
+    return mPackets.size();
+}
+
+inline void PacketQueue::enqueue(const Packet& packet)
+{
+    // the replaced packet moves to the back so that it still goes out after
+    // anything that was queued before it, i.e. a group command
+    discard(packet);
+    mPackets.append(packet);
+}
+
+inline void PacketQueue::discard(const Packet& packet)
+{
+    mPackets.removeIf([&packet](const Packet& other) {
+        return packet.destination == other.destination && packet.attribute == other.attribute;
+    });
+}
+
+inline QList<PacketQueue::Packet> PacketQueue::takeBurst()
+{
+    qsizetype count = 0;
+    while (count < mPackets.size() && mPackets[count].destination == mPackets.first().destination) {
+        ++count;
+    }
+    QList<Packet> packets = mPackets.first(count);
+    mPackets.remove(0, count);
+    return packets;
+}
+
+inline QList<PacketQueue::Packet> PacketQueue::takeAll()
+{
+    QList<Packet> packets;
+    std::swap(packets, mPackets);
+    return packets;
+}
+
+inline void PacketQueue::clear()
+{
+    mPackets.clear();
+}
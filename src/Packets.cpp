@@ -0,0 +1,61 @@
+#include "Packets.h"
+
+namespace packets {
+
+static const uint8_t commandBrightness = 0x0a;
+static const uint8_t commandTemperature = 0x1d;
+
+static QByteArray payload(uint16_t destination, uint8_t command)
+{
+    QByteArray packet(PayloadSize, '\0');
+    // little endian
+    packet[0] = static_cast<char>(destination & 0xff);
+    packet[1] = static_cast<char>(destination >> 8);
+    packet[2] = static_cast<char>(0x73);
+    packet[4] = static_cast<char>(command);
+    return packet;
+}
+
+QByteArray brightness(uint16_t destination, uint8_t brightness)
+{
+    auto packet = payload(destination, commandBrightness);
+    packet[8] = static_cast<char>(brightness);
+    return packet;
+}
+
+QByteArray temperature(uint16_t destination, uint16_t temperature)
+{
+    auto packet = payload(destination, commandTemperature);
+    packet[8] = 0x01;
+    // big endian
+    packet[9] = static_cast<char>(temperature >> 8);
+    packet[10] = static_cast<char>(temperature & 0xff);
+    return packet;
+}
+
+int count(const LightState& state)
+{
+    return (state.brightness.has_value() ? 1 : 0) + (state.temperature.has_value() ? 1 : 0);
+}
+
+bool parse(QByteArrayView payload, uint16_t* destination, LightState* state)
+{
+    if (payload.size() < PayloadSize || static_cast<uint8_t>(payload[2]) != 0x73) {
+        return false;
+    }
+    const auto data = reinterpret_cast<const uint8_t*>(payload.data());
+    switch (data[4]) {
+    case commandBrightness:
+        state->brightness = data[8];
+        break;
+    case commandTemperature:
+        state->temperature = static_cast<uint16_t>((data[9] << 8) | data[10]);
+        break;
+    default:
+        return false;
+    }
+    *destination = static_cast<uint16_t>(data[0] | (data[1] << 8));
+    return true;
+}
+
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <QByteArray>
+#include <QByteArrayView>
+#include <cstdint>
+#include <optional>
+
+// The attributes of a light a single command can change. Only the set
+// attributes are sent.
+struct LightState
+{
+    std::optional<uint8_t> brightness = {};
+    std::optional<uint16_t> temperature = {};
+};
+
+// Avi-on command payloads, the plaintext inside a mesh packet. Each command
+// carries one attribute, the destination is a csrmesh address.
+namespace packets {
+
+enum { PayloadSize = 13 };
+
+QByteArray brightness(uint16_t destination, uint8_t brightness);
+QByteArray temperature(uint16_t destination, uint16_t temperature);
+
+// the number of payloads a state turns into, one per set attribute
+int count(const LightState& state);
+
+// merges the attribute a payload sets into state, returns false for
+// anything that isn't a brightness or temperature command
+bool parse(QByteArrayView payload, uint16_t* destination, LightState* state);
+
+}
@@ -0,0 +1,382 @@
+#include "QtBluetoothTransport.h"
+#include <QCoreApplication.h>
+#include "Metrics.h"
+#include <QPermissions>
+#include <QDebug>
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+QtBluetoothLink::QtBluetoothLink(const QBluetoothDeviceInfo& info, const QBluetoothAddress& adapter, bool confirmWrites, QObject* parent)
+    : BluetoothLink(info, parent), mConfirmWrites(confirmWrites)
+{
+    if (adapter.isNull()) {
+        mController = QLowEnergyController::createCentral(info, this);
+    } else {
+        mController = QLowEnergyController::createCentral(info, adapter, this);
+    }
+    QObject::connect(mController, &QLowEnergyController::serviceDiscovered,
+                     this, &QtBluetoothLink::controllerServiceDiscovered);
+    QObject::connect(mController, &QLowEnergyController::errorOccurred,
+                     this, &BluetoothLink::errorOccurred);
+    QObject::connect(mController, &QLowEnergyController::connected,
+                     this, &BluetoothLink::connected);
+    QObject::connect(mController, &QLowEnergyController::disconnected,
+                     this, &BluetoothLink::disconnected);
+    QObject::connect(mController, &QLowEnergyController::connectionUpdated,
+                     this, &BluetoothLink::connectionUpdated);
+}
+
+QtBluetoothLink::~QtBluetoothLink()
+{
+    if (mService) {
+        QObject::disconnect(mService, &QLowEnergyService::stateChanged, this, &QtBluetoothLink::serviceStateChanged);
+        QObject::disconnect(mService, &QLowEnergyService::errorOccurred, this, &QtBluetoothLink::serviceError);
+        QObject::disconnect(mService, &QLowEnergyService::characteristicChanged, this, &QtBluetoothLink::serviceCharacteristicChanged);
+        QObject::disconnect(mService, &QLowEnergyService::characteristicWritten, this, &QtBluetoothLink::serviceCharacteristicWritten);
+        QObject::disconnect(mService, &QLowEnergyService::descriptorWritten, this, &QtBluetoothLink::serviceDescriptorWritten);
+    }
+    QObject::disconnect(mController, &QLowEnergyController::serviceDiscovered,
+                        this, &QtBluetoothLink::controllerServiceDiscovered);
+    QObject::disconnect(mController, &QLowEnergyController::errorOccurred,
+                        this, &BluetoothLink::errorOccurred);
+    QObject::disconnect(mController, &QLowEnergyController::connected,
+                        this, &BluetoothLink::connected);
+    QObject::disconnect(mController, &QLowEnergyController::disconnected,
+                        this, &BluetoothLink::disconnected);
+    QObject::disconnect(mController, &QLowEnergyController::connectionUpdated,
+                        this, &BluetoothLink::connectionUpdated);
+}
+
+void QtBluetoothLink::connectToDevice()
+{
+    mController->connectToDevice();
+}
+
+void QtBluetoothLink::discoverServices()
+{
+    mController->discoverServices();
+}
+
+void QtBluetoothLink::write(Characteristic characteristic, const QByteArray& data)
+{
+    if (!mService) {
+        return;
+    }
+    mService->writeCharacteristic(characteristic == Characteristic::Low ? mLow : mHigh, data, mWriteMode);
+}
+
+bool QtBluetoothLink::confirmsWrites() const
+{
+    return mWriteMode == QLowEnergyService::WriteWithResponse;
+}
+
+int QtBluetoothLink::mtu() const
+{
+    return mController->mtu();
+}
+
+void QtBluetoothLink::requestConnectionUpdate(const QLowEnergyConnectionParameters& parameters)
+{
+    mController->requestConnectionUpdate(parameters);
+}
+
+void QtBluetoothLink::controllerServiceDiscovered(const QBluetoothUuid& service)
+{
+    // qDebug() << "device new service" << service;
+    static const QUuid aviOnService = QUuid::fromString("0000fef1-0000-1000-8000-00805f9b34fb");
+    if (service.operator==(aviOnService)) {
+        auto serviceObject = mController->createServiceObject(service, this);
+        if (serviceObject == nullptr) {
+            qDebug() << "no service for avi-on service uuid";
+            return;
+        }
+
+        QObject::connect(serviceObject, &QLowEnergyService::stateChanged, this, &QtBluetoothLink::serviceStateChanged);
+        QObject::connect(serviceObject, &QLowEnergyService::errorOccurred, this, &QtBluetoothLink::serviceError);
+        QObject::connect(serviceObject, &QLowEnergyService::characteristicChanged, this, &QtBluetoothLink::serviceCharacteristicChanged);
+        QObject::connect(serviceObject, &QLowEnergyService::characteristicWritten, this, &QtBluetoothLink::serviceCharacteristicWritten);
+        QObject::connect(serviceObject, &QLowEnergyService::descriptorWritten, this, &QtBluetoothLink::serviceDescriptorWritten);
+        serviceObject->discoverDetails();
+
+        mService = serviceObject;
+    }
+}
+
+void QtBluetoothLink::serviceCharacteristicChanged(const QLowEnergyCharacteristic& characteristic, const QByteArray& value)
+{
+    // qDebug() << "service char changed" << characteristic.uuid() << characteristic.name() << value;
+    // packets arrive split the same way they are written, low first
+    if (characteristic.uuid() == mLow.uuid()) {
+        mNotifiedLow = value;
+    } else if (characteristic.uuid() == mHigh.uuid()) {
+        if (mNotifiedLow.isEmpty()) {
+            return;
+        }
+        emit packetReceived(mNotifiedLow + value);
+        mNotifiedLow.clear();
+    }
+}
+
+void QtBluetoothLink::serviceCharacteristicWritten(const QLowEnergyCharacteristic& characteristic, const QByteArray& value)
+{
+    Q_UNUSED(value);
+    if (characteristic.uuid() == mHigh.uuid()) {
+        emit written();
+    }
+}
+
+void QtBluetoothLink::serviceError(QLowEnergyService::ServiceError error)
+{
+    if (error == QLowEnergyService::CharacteristicWriteError) {
+        emit writeFailed();
+    }
+    emit serviceErrorOccurred(error);
+}
+
+void QtBluetoothLink::serviceDescriptorWritten(const QLowEnergyDescriptor& descriptor, const QByteArray& value)
+{
+    // qDebug() << "service descr written" << descriptor.uuid() << descriptor.name() << value;
+    if (value == QLowEnergyCharacteristic::CCCDEnableNotification) {
+        qDebug() << "notifications enabled" << deviceId(info()) << descriptor.uuid();
+    }
+}
+
+void QtBluetoothLink::enableNotifications(const QLowEnergyCharacteristic& characteristic)
+{
+    const auto cccd = characteristic.clientCharacteristicConfiguration();
+    if (!cccd.isValid()) {
+        qDebug() << "no notifications for" << characteristic.uuid();
+        return;
+    }
+    mService->writeDescriptor(cccd, QLowEnergyCharacteristic::CCCDEnableNotification);
+}
+
+void QtBluetoothLink::serviceStateChanged(QLowEnergyService::ServiceState state)
+{
+    switch (state) {
+    case QLowEnergyService::RemoteServiceDiscovering:
+        // qDebug() << "service discovering" << mService;
+        break;
+    case QLowEnergyService::RemoteServiceDiscovered: {
+        // for (const auto& charr : mService->characteristics()) {
+        //     qDebug() << charr.name() << charr.uuid();
+        // }
+
+        static const QUuid characteristicLow = QUuid::fromString("c4edc000-9daf-11e3-8003-00025b000b00");
+        static const QUuid characteristicHigh = QUuid::fromString("c4edc000-9daf-11e3-8004-00025b000b00");
+        const auto low = mService->characteristic(characteristicLow);
+        const auto high = mService->characteristic(characteristicHigh);
+        if (low.isValid() && high.isValid()) {
+            mLow = low;
+            mHigh = high;
+            // Qt only reports completion and errors for writes with response,
+            // only the adaptive pacer needs them
+            mWriteMode = mConfirmWrites && (high.properties() & QLowEnergyCharacteristic::Write) ? QLowEnergyService::WriteWithResponse : QLowEnergyService::WriteWithoutResponse;
+            qDebug() << "writes to" << deviceId(info()) << (confirmsWrites() ? "with response" : "without response");
+            enableNotifications(mLow);
+            enableNotifications(mHigh);
+            emit ready();
+        }
+        // qDebug() << "service discovered" << mService << low.isValid() << high.isValid();
+        break; }
+    default:
+        break;
+    }
+}
+
+QtBluetoothTransport::QtBluetoothTransport(const Options& options, const QList<QBluetoothUuid>& approved, QObject* parent)
+    : BluetoothTransport(options.maxConnects, options.connectTimeout, parent),
+      mConfirmWrites(options.minDeviceDelay < options.deviceDelay), mApproved(approved.cbegin(), approved.cend())
+{
+    if (options.adapters.isEmpty()) {
+        mAdapters.append(Adapter { {}, "default" });
+    } else {
+        for (const auto& address : options.adapters.split(',')) {
+            const QBluetoothAddress adapter(address.trimmed());
+            mAdapters.append(Adapter { adapter, adapter.toString().toUtf8() });
+        }
+    }
+    for (int i = 0; i < mAdapters.size(); ++i) {
+        createAgent(i);
+    }
+
+    metrics::addCollector(this, [this](metrics::Writer& writer) {
+        writer.describe("halo_adapter_links", "gauge", "device links per local adapter");
+        for (const auto& adapter : mAdapters) {
+            writer.sample("halo_adapter_links").label("adapter", adapter.label).value(static_cast<uint64_t>(adapter.links));
+        }
+        writer.describe("halo_adapter_wedged", "gauge", "whether new links avoid the adapter after repeated connect failures");
+        const auto now = metrics::now();
+        for (const auto& adapter : mAdapters) {
+            writer.sample("halo_adapter_wedged").label("adapter", adapter.label).value(static_cast<uint64_t>(adapter.wedgedUntil > now ? 1 : 0));
+        }
+    });
+}
+
+QtBluetoothTransport::~QtBluetoothTransport()
+{
+    metrics::removeCollector(this);
+    for (auto& adapter : mAdapters) {
+        delete adapter.agent;
+    }
+}
+
+void QtBluetoothTransport::createAgent(int adapter)
+{
+    auto& entry = mAdapters[adapter];
+    entry.agent = entry.address.isNull() ? new QBluetoothDeviceDiscoveryAgent(this) : new QBluetoothDeviceDiscoveryAgent(entry.address, this);
+    QObject::connect(entry.agent, &QBluetoothDeviceDiscoveryAgent::deviceDiscovered,
+                     this, [this, adapter](const QBluetoothDeviceInfo& info) {
+                         // everything else nearby stops at the lookup
+                         if (mAdapters.size() > 1) {
+                             const auto id = deviceId(info);
+                             if (mApproved.contains(id)) {
+                                 auto& signal = mSignal[id];
+                                 signal.resize(mAdapters.size());
+                                 signal[adapter] = info.rssi();
+                             }
+                         }
+                         emit deviceDiscovered(info);
+                     });
+}
+
+void QtBluetoothTransport::releaseAgent(int adapter)
+{
+    auto& entry = mAdapters[adapter];
+    QObject::disconnect(entry.agent, &QBluetoothDeviceDiscoveryAgent::deviceDiscovered, this, nullptr);
+    entry.agent->deleteLater();
+    entry.agent = nullptr;
+}
+
+void QtBluetoothTransport::initialize()
+{
+    auto app = QCoreApplication::instance();
+
+    QBluetoothPermission bluetoothPermission;
+    bluetoothPermission.setCommunicationModes(QBluetoothPermission::Access);
+    switch (app->checkPermission(bluetoothPermission)) {
+    case Qt::PermissionStatus::Undetermined:
+    case Qt::PermissionStatus::Denied:
+        // ask for permission
+        app->requestPermission(bluetoothPermission, this, [this](const QPermission& permission) {
+            switch (permission.status()) {
+            case Qt::PermissionStatus::Denied:
+                emit error(Error::PermissionError);
+                break;
+            case Qt::PermissionStatus::Granted:
+                emit ready();
+                break;
+            default:
+                // should never happen
+                assert(false && "Impossible impossibility");
+                break;
+            }
+        });
+        break;
+    case Qt::PermissionStatus::Granted:
+        emit ready();
+        break;
+    }
+}
+
+void QtBluetoothTransport::startDiscovery()
+{
+    // qDebug() << "discovering";
+    for (const auto& adapter : mAdapters) {
+        adapter.agent->start(QBluetoothDeviceDiscoveryAgent::LowEnergyMethod);
+    }
+}
+
+void QtBluetoothTransport::rediscover()
+{
+    for (int i = 0; i < mAdapters.size(); ++i) {
+        if (mAdapters[i].agent) {
+            releaseAgent(i);
+        }
+        createAgent(i);
+        mAdapters[i].agent->start(QBluetoothDeviceDiscoveryAgent::LowEnergyMethod);
+    }
+}
+
+BluetoothLink* QtBluetoothTransport::createLink(const QBluetoothDeviceInfo& info, QObject* parent)
+{
+    const auto adapter = pickAdapter(info);
+    // fresh readings for the next link once this one is gone
+    const auto id = deviceId(info);
+    mSignal.remove(id);
+    auto link = new QtBluetoothLink(info, mAdapters[adapter].address, mConfirmWrites, parent);
+    link->setAdapter(adapter);
+    ++mAdapters[adapter].links;
+
+    QObject::connect(link, &BluetoothLink::connected, this, [this, adapter]() {
+        mAdapters[adapter].failures = 0;
+    });
+    QObject::connect(link, &BluetoothLink::errorOccurred, this, [this, adapter]() {
+        linkFailed(adapter);
+    });
+    QObject::connect(link, &QObject::destroyed, this, [this, adapter, id]() {
+        --mAdapters[adapter].links;
+        mSignal.remove(id);
+    });
+    return link;
+}
+
+QByteArray QtBluetoothTransport::adapterLabel(int adapter) const
+{
+    return mAdapters[adapter].label;
+}
+
+int QtBluetoothTransport::pickAdapter(const QBluetoothDeviceInfo& info) const
+{
+    if (mAdapters.size() == 1) {
+        return 0;
+    }
+    // wedged adapters are only used when there is nothing else
+    const auto now = metrics::now();
+    bool anyHealthy = false;
+    uint32_t fewest = std::numeric_limits<uint32_t>::max();
+    for (const auto& adapter : mAdapters) {
+        if (adapter.wedgedUntil <= now) {
+            anyHealthy = true;
+            fewest = std::min(fewest, adapter.links);
+        }
+    }
+    if (!anyHealthy) {
+        for (const auto& adapter : mAdapters) {
+            fewest = std::min(fewest, adapter.links);
+        }
+    }
+
+    // within one link of the least loaded, the adapter that hears the device
+    // best wins
+    const auto signal = mSignal.value(deviceId(info));
+    int best = -1;
+    qint16 bestRssi = 0;
+    for (int i = 0; i < mAdapters.size(); ++i) {
+        const auto& adapter = mAdapters[i];
+        if ((anyHealthy && adapter.wedgedUntil > now) || adapter.links > fewest + 1) {
+            continue;
+        }
+        const qint16 rssi = i < signal.size() && signal[i] != 0 ? signal[i] : -127;
+        if (best == -1 || rssi > bestRssi || (rssi == bestRssi && adapter.links < mAdapters[best].links)) {
+            best = i;
+            bestRssi = rssi;
+        }
+    }
+    return best;
+}
+
+void QtBluetoothTransport::linkFailed(int adapter)
+{
+    auto& entry = mAdapters[adapter];
+    if (++entry.failures < 3 || mAdapters.size() == 1) {
+        return;
+    }
+    // keeps failing, give the other adapters the new links for a minute
+    qDebug() << "adapter" << entry.label << "wedged after" << entry.failures << "failed connects";
+    entry.failures = 0;
+    entry.wedgedUntil = metrics::now() + 60ll * 1000000000ll;
+}
+
+#include "moc_QtBluetoothTransport.cpp"
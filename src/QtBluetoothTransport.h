@@ -0,0 +1,93 @@
+#pragma once
+
+#include "BluetoothTransport.h"
+#include "Options.h"
+#include <QBluetoothAddress>
+#include <QBluetoothDeviceDiscoveryAgent>
+#include <QHash>
+#include <QList>
+#include <QSet>
+#include <QLowEnergyCharacteristic>
+#include <QLowEnergyController>
+#include <QLowEnergyService>
+
+class QtBluetoothLink : public BluetoothLink
+{
+    Q_OBJECT
+public:
+    // a null adapter is the system default. confirmWrites writes with response
+    // when the device allows it, a round trip per packet that only pays off
+    // with adaptive pacing
+    QtBluetoothLink(const QBluetoothDeviceInfo& info, const QBluetoothAddress& adapter, bool confirmWrites, QObject* parent);
+    ~QtBluetoothLink() override;
+
+    void connectToDevice() override;
+    void discoverServices() override;
+    void write(Characteristic characteristic, const QByteArray& data) override;
+    bool confirmsWrites() const override;
+    int mtu() const override;
+    void requestConnectionUpdate(const QLowEnergyConnectionParameters& parameters) override;
+
+private slots:
+    void controllerServiceDiscovered(const QBluetoothUuid& service);
+    void serviceCharacteristicChanged(const QLowEnergyCharacteristic& characteristic, const QByteArray& value);
+    void serviceCharacteristicWritten(const QLowEnergyCharacteristic& characteristic, const QByteArray& value);
+    void serviceDescriptorWritten(const QLowEnergyDescriptor& descriptor, const QByteArray& value);
+    void serviceStateChanged(QLowEnergyService::ServiceState state);
+    void serviceError(QLowEnergyService::ServiceError error);
+
+private:
+    void enableNotifications(const QLowEnergyCharacteristic& characteristic);
+
+    QLowEnergyController* mController = nullptr;
+    QLowEnergyService* mService = nullptr;
+    QLowEnergyCharacteristic mLow = {}, mHigh = {};
+    bool mConfirmWrites;
+    QLowEnergyService::WriteMode mWriteMode = QLowEnergyService::WriteWithoutResponse;
+    QByteArray mNotifiedLow;
+};
+
+// Scans and connects through one or more local adapters. New links go to the
+// least loaded adapter, preferring the one that hears the device best, and an
+// adapter whose connects keep failing is left alone for a while.
+class QtBluetoothTransport : public BluetoothTransport
+{
+    Q_OBJECT
+public:
+    // adapter signal is only tracked for the approved devices, see deviceId()
+    QtBluetoothTransport(const Options& options, const QList<QBluetoothUuid>& approved, QObject* parent = nullptr);
+    ~QtBluetoothTransport() override;
+
+    void initialize() override;
+    void startDiscovery() override;
+    void rediscover() override;
+    BluetoothLink* createLink(const QBluetoothDeviceInfo& info, QObject* parent) override;
+
+protected:
+    QByteArray adapterLabel(int adapter) const override;
+
+private:
+    struct Adapter
+    {
+        QBluetoothAddress address = {};
+        QByteArray label = {};
+        QBluetoothDeviceDiscoveryAgent* agent = nullptr;
+        uint32_t links = 0;
+        // consecutive failed connects
+        uint32_t failures = 0;
+        qint64 wedgedUntil = 0;
+    };
+
+    void createAgent(int adapter);
+    void releaseAgent(int adapter);
+    int pickAdapter(const QBluetoothDeviceInfo& info) const;
+    void linkFailed(int adapter);
+
+    // see QtBluetoothLink
+    bool mConfirmWrites;
+    QList<Adapter> mAdapters;
+    QSet<QBluetoothUuid> mApproved;
+    // the last rssi of each approved device without a link as heard by each
+    // adapter, 0 if never
+    QHash<QBluetoothUuid, QList<qint16>> mSignal;
+};
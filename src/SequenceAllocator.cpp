@@ -0,0 +1,67 @@
+#include "SequenceAllocator.h"
+#include <QFile>
+#include <QRandomGenerator>
+#include <QSaveFile>
+#include <QtEndian>
+#include <QDebug>
+#include <cstring>
+
+// "HSEQ", u32 first sequence number after the last lease, little endian
+static const char magic[4] = { 'H', 'S', 'E', 'Q' };
+enum { FileSize = 8 };
+
+SequenceAllocator::SequenceAllocator(uint32_t leaseSize)
+    : mLeaseSize(leaseSize)
+{
+    mNext = mLeaseEnd = QRandomGenerator::global()->bounded(1u, static_cast<uint32_t>(MaxSequence) + 1);
+}
+
+void SequenceAllocator::load(const QString& file)
+{
+    mFile = file;
+
+    QFile qfile(file);
+    if (!qfile.open(QFile::ReadOnly)) {
+        return;
+    }
+    const auto data = qfile.read(FileSize);
+    if (data.size() != FileSize || memcmp(data.constData(), magic, sizeof(magic)) != 0) {
+        qDebug() << "invalid sequence lease" << file;
+        return;
+    }
+    const auto seq = qFromLittleEndian<uint32_t>(data.constData() + 4);
+    if (seq == 0 || seq > MaxSequence) {
+        qDebug() << "invalid sequence lease" << file << seq;
+        return;
+    }
+    // nothing leased yet, the first next() takes a block from here
+    mNext = mLeaseEnd = seq;
+    qDebug() << "sequence numbers continue at" << seq;
+}
+
+uint32_t SequenceAllocator::next()
+{
+    if (mNext == mLeaseEnd) {
+        lease();
+    }
+    const auto seq = mNext;
+    mNext = advance(mNext, 1);
+    return seq;
+}
+
+void SequenceAllocator::lease()
+{
+    mLeaseEnd = advance(mNext, mLeaseSize);
+    if (mFile.isEmpty()) {
+        return;
+    }
+
+    char data[FileSize];
+    memcpy(data, magic, sizeof(magic));
+    qToLittleEndian<uint32_t>(mLeaseEnd, data + 4);
+    QSaveFile qfile(mFile);
+    if (!qfile.open(QFile::WriteOnly) || qfile.write(data, FileSize) != FileSize || !qfile.commit()) {
+        // carry on, only a restart before the next lease could reuse numbers
+        qDebug() << "unable to write sequence lease" << mFile << qfile.errorString();
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <QString>
+#include <cstdint>
+
+// Hands out csrmesh sequence numbers in order, 1 to 0xffffff and around.
+// Numbers are leased from a file a block at a time, a restart continues
+// after the last lease so nothing is reused and only one write is needed
+// per block. Whatever was left of the lease is skipped.
+class SequenceAllocator
+{
+public:
+    enum { MaxSequence = 0xffffff };
+
+    SequenceAllocator(uint32_t leaseSize = 4096);
+
+    // without a file or a stored lease numbers start at a random point
+    void load(const QString& file);
+
+    uint32_t next();
+    // the first number of the next lease
+    uint32_t leaseEnd() const;
+
+private:
+    void lease();
+    static uint32_t advance(uint32_t seq, uint32_t count);
+
+    QString mFile;
+    uint32_t mLeaseSize;
+    uint32_t mNext = 1, mLeaseEnd = 1;
+};
+
+inline uint32_t SequenceAllocator::leaseEnd() const
+{
+    return mLeaseEnd;
+}
+
+inline uint32_t SequenceAllocator::advance(uint32_t seq, uint32_t count)
+{
+    return static_cast<uint32_t>((static_cast<uint64_t>(seq) - 1 + count) % MaxSequence) + 1;
+}
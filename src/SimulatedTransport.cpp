@@ -0,0 +1,311 @@
+#include "SimulatedTransport.h"
+#include "Metrics.h"
+#include "Packets.h"
+#include <QDebug>
+
+// how long the lights remember a sequence number, in nanoseconds
+static const qint64 sequenceTimeout = 10000000000ll;
+
+SimulatedLink::SimulatedLink(SimulatedTransport* transport, const QBluetoothDeviceInfo& info, QObject* parent)
+    : BluetoothLink(info, parent), mTransport(transport)
+{
+    mTransport->mLinks.append(this);
+}
+
+SimulatedLink::~SimulatedLink()
+{
+    mTransport->mLinks.removeOne(this);
+}
+
+void SimulatedLink::notify(const QByteArray& packet)
+{
+    if (mConnected) {
+        emit packetReceived(packet);
+    }
+}
+
+void SimulatedLink::connectToDevice()
+{
+    QTimer::singleShot(mTransport->connectLatency(), this, [this]() {
+        if (mConnected) {
+            return;
+        }
+        mConnected = true;
+        ++mTransport->mStats.connects;
+        emit connected();
+    });
+}
+
+void SimulatedLink::discoverServices()
+{
+    QTimer::singleShot(mTransport->connectLatency() / 2, this, [this]() {
+        if (mConnected) {
+            emit ready();
+        }
+    });
+}
+
+int SimulatedLink::mtu() const
+{
+    // what a phone typically negotiates, the simulated firmware takes a
+    // whole packet on the high characteristic
+    return 247;
+}
+
+void SimulatedLink::requestConnectionUpdate(const QLowEnergyConnectionParameters& parameters)
+{
+    // always granted
+    QTimer::singleShot(mTransport->connectLatency() / 4, this, [this, parameters]() {
+        if (mConnected) {
+            emit connectionUpdated(parameters);
+        }
+    });
+}
+
+bool SimulatedLink::confirmsWrites() const
+{
+    // like a write with response
+    return true;
+}
+
+void SimulatedLink::write(Characteristic characteristic, const QByteArray& data)
+{
+    if (!mConnected) {
+        emit writeFailed();
+        emit serviceErrorOccurred(QLowEnergyService::CharacteristicWriteError);
+        return;
+    }
+    if (characteristic == Characteristic::Low) {
+        mLow = data;
+        return;
+    }
+
+    const QByteArray packet = mLow + data;
+    mLow.clear();
+    if (mTransport->shouldDrop()) {
+        ++mTransport->mStats.dropped;
+        QTimer::singleShot(mTransport->writeLatency(), this, [this]() {
+            emit writeFailed();
+        });
+    } else {
+        QTimer::singleShot(mTransport->writeLatency(), this, [this, transport = mTransport, packet]() {
+            transport->receivePacket(packet);
+            emit written();
+        });
+    }
+
+    if (mTransport->shouldDisconnect()) {
+        mConnected = false;
+        ++mTransport->mStats.disconnects;
+        QTimer::singleShot(0, this, [this]() {
+            emit disconnected();
+        });
+    }
+}
+
+SimulatedTransport::SimulatedTransport(const Options& options, const Locations& locations, const QList<QBluetoothUuid>& lights, QObject* parent)
+    : BluetoothTransport(options.maxConnects, options.connectTimeout, parent), mConnectLatency(options.simulateConnectLatency), mWriteLatency(options.simulateWriteLatency),
+      mSwitchInterval(options.simulateSwitchInterval), mAdverts(options.simulateAdverts),
+      mDropRate(options.simulateDropRate), mDisconnectRate(options.simulateDisconnectRate), mLights(lights)
+{
+    qDebug() << "simulating" << mLights.size() << "lights, connect latency" << mConnectLatency
+             << "write latency" << mWriteLatency << "drop rate" << mDropRate << "disconnect rate" << mDisconnectRate
+             << "switch interval" << mSwitchInterval << "noise adverts" << mAdverts;
+
+    for (const auto& location : locations) {
+        Mesh mesh;
+        mesh.locationId = location.id;
+        mesh.encoder.setKey(crypto::generateKey(location.passphrase.toUtf8() + QByteArray::fromHex("004d4350")));
+        for (const auto& device : location.devices) {
+            mesh.devices.append(device.did);
+        }
+        for (const auto& group : location.groups) {
+            mesh.groups.insert(groupAddress(group.gid), group.devices);
+        }
+        mMeshes.append(std::move(mesh));
+    }
+
+    mStatsTimer.setInterval(10000);
+    QObject::connect(&mStatsTimer, &QTimer::timeout, this, &SimulatedTransport::logStats);
+    mSwitchTimer.setInterval(mSwitchInterval);
+    QObject::connect(&mSwitchTimer, &QTimer::timeout, this, &SimulatedTransport::flipSwitch);
+
+    if (mAdverts > 0) {
+        // a neighbourhood of phones, beacons and someone else's lights
+        static const QString names[] = { QStringLiteral("Avi-on"), QString(), QStringLiteral("Tile"), QStringLiteral("[TV] Samsung") };
+        for (int i = 0; i < 500; ++i) {
+            QBluetoothDeviceInfo info(QBluetoothUuid(QUuid::createUuid()), names[i % 4], 0);
+            info.setCoreConfigurations(QBluetoothDeviceInfo::LowEnergyCoreConfiguration);
+            mNoise.append(std::move(info));
+        }
+    }
+    mAdvertTimer.setInterval(100);
+    QObject::connect(&mAdvertTimer, &QTimer::timeout, this, &SimulatedTransport::advertiseNoise);
+}
+
+SimulatedTransport::~SimulatedTransport()
+{
+}
+
+void SimulatedTransport::initialize()
+{
+    mStatsTimer.start();
+    if (mSwitchInterval > 0) {
+        mSwitchTimer.start();
+    }
+    if (mAdverts > 0) {
+        mAdvertTimer.start();
+    }
+    emit ready();
+}
+
+void SimulatedTransport::startDiscovery()
+{
+    // lights show up over the course of a scan
+    for (const auto& uuid : mLights) {
+        QBluetoothDeviceInfo info(uuid, QStringLiteral("Avi-on"), 0);
+        info.setCoreConfigurations(QBluetoothDeviceInfo::LowEnergyCoreConfiguration);
+        QTimer::singleShot(connectLatency(), this, [this, info]() {
+            emit deviceDiscovered(info);
+        });
+    }
+}
+
+void SimulatedTransport::rediscover()
+{
+    startDiscovery();
+}
+
+BluetoothLink* SimulatedTransport::createLink(const QBluetoothDeviceInfo& info, QObject* parent)
+{
+    return new SimulatedLink(this, info, parent);
+}
+
+uint32_t SimulatedTransport::connectLatency()
+{
+    // +-50% around the configured latency
+    return mConnectLatency / 2 + mRandom.bounded(mConnectLatency + 1);
+}
+
+uint32_t SimulatedTransport::writeLatency()
+{
+    return mWriteLatency / 2 + mRandom.bounded(mWriteLatency + 1);
+}
+
+bool SimulatedTransport::shouldDrop()
+{
+    return mDropRate > 0 && mRandom.generateDouble() < mDropRate;
+}
+
+bool SimulatedTransport::shouldDisconnect()
+{
+    return mDisconnectRate > 0 && mRandom.generateDouble() < mDisconnectRate;
+}
+
+// long load runs see millions of sequence numbers, the replay window only
+// has to outlast the retries of one
+void SimulatedTransport::pruneSequences(Mesh& mesh, qint64 now)
+{
+    // at most once a second
+    if (now - mesh.seqsPruned < 1000000000ll) {
+        return;
+    }
+    mesh.seqsPruned = now;
+    mesh.seenSeqs.removeIf([now](const auto& it) {
+        return now - it.value() > sequenceTimeout;
+    });
+}
+
+void SimulatedTransport::receivePacket(const QByteArray& packet)
+{
+    ++mStats.packets;
+    for (auto& mesh : mMeshes) {
+        uint8_t payload[crypto::PacketEncoder::MaxDataSize];
+        uint32_t seq;
+        const auto size = mesh.encoder.decode(packet, payload, &seq);
+        if (size < 0) {
+            continue;
+        }
+        if (mesh.seenSeqs.contains(seq)) {
+            // the lights drop anything that looks like a replay
+            ++mStats.replayed;
+            return;
+        }
+        const auto now = metrics::now();
+        pruneSequences(mesh, now);
+        mesh.seenSeqs.insert(seq, now);
+
+        uint16_t destination;
+        LightState command;
+        if (!packets::parse(QByteArrayView(payload, size), &destination, &command)) {
+            qDebug() << "sim: unknown payload" << QByteArray(reinterpret_cast<const char*>(payload), size).toHex();
+            return;
+        }
+        for (const auto did : resolveDestination(mesh, destination)) {
+            auto& state = mStates[(static_cast<uint64_t>(mesh.locationId) << 32) | did];
+            state.brightness = command.brightness.value_or(state.brightness);
+            state.temperature = command.temperature.value_or(state.temperature);
+            qDebug() << "sim: light" << mesh.locationId << did << "brightness" << state.brightness << "temperature" << state.temperature;
+        }
+
+        // every light relays what it sees, so every connected link notifies it
+        QTimer::singleShot(writeLatency(), this, [this, packet]() {
+            for (auto link : mLinks) {
+                link->notify(packet);
+            }
+        });
+        return;
+    }
+    ++mStats.rejected;
+}
+
+QList<uint32_t> SimulatedTransport::resolveDestination(const Mesh& mesh, uint16_t destination) const
+{
+    const auto group = mesh.groups.constFind(destination);
+    if (group != mesh.groups.cend() && !group->isEmpty()) {
+        return *group;
+    }
+    if (destination == 0) {
+        return mesh.devices;
+    }
+    return { static_cast<uint32_t>(destination - 0x8080) };
+}
+
+void SimulatedTransport::flipSwitch()
+{
+    if (mMeshes.isEmpty()) {
+        return;
+    }
+    auto& mesh = mMeshes[mRandom.bounded(static_cast<int>(mMeshes.size()))];
+    if (mesh.devices.isEmpty()) {
+        return;
+    }
+    const auto did = mesh.devices[mRandom.bounded(static_cast<int>(mesh.devices.size()))];
+    const auto& state = mStates[(static_cast<uint64_t>(mesh.locationId) << 32) | did];
+    const uint8_t brightness = state.brightness > 0 ? 0 : 255;
+    qDebug() << "sim: switch" << mesh.locationId << did << "to" << brightness;
+
+    uint8_t packet[crypto::PacketEncoder::MaxPacketSize];
+    const auto size = mesh.encoder.encode(mRandom.bounded(1, 16777215), packets::brightness(deviceAddress(did), brightness), packet);
+    receivePacket(QByteArray(reinterpret_cast<const char*>(packet), size));
+}
+
+void SimulatedTransport::logStats()
+{
+    qDebug() << "sim: connects" << mStats.connects << "disconnects" << mStats.disconnects
+             << "packets" << mStats.packets << "dropped" << mStats.dropped
+             << "rejected" << mStats.rejected << "replayed" << mStats.replayed
+             << "adverts" << mStats.adverts;
+}
+
+void SimulatedTransport::advertiseNoise()
+{
+    // --simulate-adverts is per second, the timer ticks ten times a second
+    const uint32_t count = mAdverts / 10 + (mRandom.bounded(10u) < mAdverts % 10 ? 1 : 0);
+    for (uint32_t i = 0; i < count; ++i) {
+        emit deviceDiscovered(mNoise[mRandom.bounded(static_cast<int>(mNoise.size()))]);
+    }
+    mStats.adverts += count;
+}
+
+#include "moc_SimulatedTransport.cpp"
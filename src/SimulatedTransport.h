@@ -0,0 +1,107 @@
+#pragma once
+
+#include "BluetoothTransport.h"
+#include "Crypto.h"
+#include "Locations.h"
+#include "Options.h"
+#include <QHash>
+#include <QList>
+#include <QRandomGenerator>
+#include <QTimer>
+#include <cstdint>
+
+class SimulatedTransport;
+
+class SimulatedLink : public BluetoothLink
+{
+    Q_OBJECT
+public:
+    SimulatedLink(SimulatedTransport* transport, const QBluetoothDeviceInfo& info, QObject* parent);
+    ~SimulatedLink() override;
+
+    void connectToDevice() override;
+    void discoverServices() override;
+    void write(Characteristic characteristic, const QByteArray& data) override;
+    bool confirmsWrites() const override;
+    int mtu() const override;
+    void requestConnectionUpdate(const QLowEnergyConnectionParameters& parameters) override;
+
+    // a packet on the mesh, delivered if the link is connected
+    void notify(const QByteArray& packet);
+
+private:
+    SimulatedTransport* mTransport;
+    QByteArray mLow;
+    bool mConnected = false;
+};
+
+// In-process stand-in for a mesh of Avi-on lights. Every approved device is a
+// simulated light; packets written to any of them are verified and decrypted
+// with the location keys and applied to the whole mesh, then relayed to every
+// connected link as a notification. A simulated wall switch can change
+// lights behind the bridge's back, and unrelated devices nearby can flood the
+// scan with adverts.
+class SimulatedTransport : public BluetoothTransport
+{
+    Q_OBJECT
+public:
+    SimulatedTransport(const Options& options, const Locations& locations, const QList<QBluetoothUuid>& lights, QObject* parent = nullptr);
+    ~SimulatedTransport() override;
+
+    void initialize() override;
+    void startDiscovery() override;
+    void rediscover() override;
+    BluetoothLink* createLink(const QBluetoothDeviceInfo& info, QObject* parent) override;
+
+private slots:
+    void logStats();
+    void flipSwitch();
+    void advertiseNoise();
+
+private:
+    friend class SimulatedLink;
+
+    uint32_t connectLatency();
+    uint32_t writeLatency();
+    bool shouldDrop();
+    bool shouldDisconnect();
+    void receivePacket(const QByteArray& packet);
+
+    struct Mesh
+    {
+        uint32_t locationId = 0;
+        crypto::PacketEncoder encoder;
+        // sequence number to when it was seen, see pruneSequences()
+        QHash<uint32_t, qint64> seenSeqs;
+        qint64 seqsPruned = 0;
+        QList<uint32_t> devices;
+        QHash<uint16_t, QList<uint32_t>> groups;
+    };
+
+    QList<uint32_t> resolveDestination(const Mesh& mesh, uint16_t destination) const;
+    static void pruneSequences(Mesh& mesh, qint64 now);
+
+    struct Light
+    {
+        uint8_t brightness = 0;
+        uint16_t temperature = 0;
+    };
+
+    struct Stats
+    {
+        uint64_t connects = 0, disconnects = 0;
+        uint64_t packets = 0, dropped = 0, rejected = 0, replayed = 0;
+        uint64_t adverts = 0;
+    };
+
+    uint32_t mConnectLatency, mWriteLatency, mSwitchInterval, mAdverts;
+    double mDropRate, mDisconnectRate;
+    QList<QBluetoothUuid> mLights;
+    QList<QBluetoothDeviceInfo> mNoise;
+    QList<Mesh> mMeshes;
+    QList<SimulatedLink*> mLinks;
+    QHash<uint64_t, Light> mStates;
+    QRandomGenerator mRandom;
+    QTimer mStatsTimer, mSwitchTimer, mAdvertTimer;
+    Stats mStats;
+};
@@ -0,0 +1,151 @@
+#include "StateSnapshot.h"
+#include "BluetoothTransport.h"
+#include <QFile>
+#include <QSaveFile>
+#include <QtEndian>
+#include <cstring>
+#include <QDebug>
+
+// all little endian
+//   header: "HALO", u32 version, u32 light count, u32 device count
+//   light:  u16 destination, u8 flags, u8 brightness, u16 temperature
+//   device: 16 byte uuid, u64 address, u8 core configurations, s16 rssi,
+//           u16 name size, utf-8 name
+static const char magic[4] = { 'H', 'A', 'L', 'O' };
+static const uint32_t version = 1;
+enum { HeaderSize = 16, LightSize = 6, DeviceSize = 29 };
+enum { HasBrightness = 0x1, HasTemperature = 0x2 };
+
+bool StateSnapshot::load(const QString& file)
+{
+    QFile qfile(file);
+    if (!qfile.open(QFile::ReadOnly)) {
+        return false;
+    }
+    const auto size = qfile.size();
+    if (size < HeaderSize) {
+        qDebug() << "state snapshot too small" << file;
+        return false;
+    }
+    const uchar* data = qfile.map(0, size);
+    if (data == nullptr) {
+        qDebug() << "unable to map state snapshot" << file;
+        return false;
+    }
+    const uchar* end = data + size;
+
+    bool ok = false;
+    const uchar* cur = data;
+    if (memcmp(cur, magic, sizeof(magic)) == 0 && qFromLittleEndian<uint32_t>(cur + 4) == version) {
+        const auto lightCount = qFromLittleEndian<uint32_t>(cur + 8);
+        const auto deviceCount = qFromLittleEndian<uint32_t>(cur + 12);
+        cur += HeaderSize;
+
+        QHash<uint16_t, LightState> lights;
+        QList<QBluetoothDeviceInfo> devices;
+        ok = static_cast<qint64>(lightCount) * LightSize <= end - cur;
+        for (uint32_t i = 0; ok && i < lightCount; ++i, cur += LightSize) {
+            const auto flags = cur[2];
+            auto& state = lights[qFromLittleEndian<uint16_t>(cur)];
+            if (flags & HasBrightness) {
+                state.brightness = cur[3];
+            }
+            if (flags & HasTemperature) {
+                state.temperature = qFromLittleEndian<uint16_t>(cur + 4);
+            }
+        }
+        for (uint32_t i = 0; ok && i < deviceCount; ++i) {
+            if (end - cur < DeviceSize) {
+                ok = false;
+                break;
+            }
+            const auto uuid = QBluetoothUuid(QUuid::fromRfc4122(QByteArrayView(cur, 16)));
+            const auto address = QBluetoothAddress(qFromLittleEndian<quint64>(cur + 16));
+            const auto coreConfigurations = QBluetoothDeviceInfo::CoreConfigurations(cur[24]);
+            const auto rssi = qFromLittleEndian<qint16>(cur + 25);
+            const auto nameSize = qFromLittleEndian<uint16_t>(cur + 27);
+            cur += DeviceSize;
+            if (end - cur < nameSize) {
+                ok = false;
+                break;
+            }
+            const auto name = QString::fromUtf8(reinterpret_cast<const char*>(cur), nameSize);
+            cur += nameSize;
+
+            QBluetoothDeviceInfo info = address.isNull() ? QBluetoothDeviceInfo(uuid, name, 0) : QBluetoothDeviceInfo(address, name, 0);
+            info.setDeviceUuid(uuid);
+            info.setCoreConfigurations(coreConfigurations);
+            info.setRssi(rssi);
+            devices.append(std::move(info));
+        }
+        if (ok) {
+            mLights = std::move(lights);
+            mDevices = std::move(devices);
+        }
+    }
+    qfile.unmap(const_cast<uchar*>(data));
+
+    if (!ok) {
+        qDebug() << "invalid state snapshot" << file;
+    }
+    return ok;
+}
+
+bool StateSnapshot::save(const QString& file) const
+{
+    qsizetype size = HeaderSize + mLights.size() * LightSize;
+    QList<QByteArray> names;
+    names.reserve(mDevices.size());
+    for (const auto& info : mDevices) {
+        names.append(info.name().toUtf8().left(0xffff));
+        size += DeviceSize + names.last().size();
+    }
+
+    QByteArray out(size, '\0');
+    auto cur = reinterpret_cast<uchar*>(out.data());
+    memcpy(cur, magic, sizeof(magic));
+    qToLittleEndian<uint32_t>(version, cur + 4);
+    qToLittleEndian<uint32_t>(static_cast<uint32_t>(mLights.size()), cur + 8);
+    qToLittleEndian<uint32_t>(static_cast<uint32_t>(mDevices.size()), cur + 12);
+    cur += HeaderSize;
+
+    for (auto it = mLights.cbegin(), itEnd = mLights.cend(); it != itEnd; ++it, cur += LightSize) {
+        const auto& state = it.value();
+        qToLittleEndian<uint16_t>(it.key(), cur);
+        cur[2] = (state.brightness.has_value() ? HasBrightness : 0) | (state.temperature.has_value() ? HasTemperature : 0);
+        cur[3] = state.brightness.value_or(0);
+        qToLittleEndian<uint16_t>(state.temperature.value_or(0), cur + 4);
+    }
+    for (qsizetype i = 0; i < mDevices.size(); ++i) {
+        const auto& info = mDevices[i];
+        const auto uuid = info.deviceUuid().toRfc4122();
+        memcpy(cur, uuid.constData(), 16);
+        qToLittleEndian<quint64>(info.address().toUInt64(), cur + 16);
+        cur[24] = static_cast<uchar>(info.coreConfigurations());
+        qToLittleEndian<qint16>(info.rssi(), cur + 25);
+        qToLittleEndian<uint16_t>(static_cast<uint16_t>(names[i].size()), cur + 27);
+        cur += DeviceSize;
+        memcpy(cur, names[i].constData(), names[i].size());
+        cur += names[i].size();
+    }
+
+    // written to a temporary file and renamed over the old snapshot on commit
+    QSaveFile qfile(file);
+    if (!qfile.open(QFile::WriteOnly) || qfile.write(out) != out.size() || !qfile.commit()) {
+        qDebug() << "unable to write state snapshot" << file << qfile.errorString();
+        return false;
+    }
+    return true;
+}
+
+void StateSnapshot::setDevice(const QBluetoothDeviceInfo& info)
+{
+    // by deviceId(), on Apple the address of a cached device may have gone stale
+    for (auto& other : mDevices) {
+        if (deviceId(other) == deviceId(info)) {
+            other = info;
+            return;
+        }
+    }
+    mDevices.append(info);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "Packets.h"
+#include <QBluetoothDeviceInfo>
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <cstdint>
+
+// Last known light states and discovered devices, saved atomically to a
+// compact binary file and memory mapped on load so a restart can publish
+// state before any device has connected.
+class StateSnapshot
+{
+public:
+    bool load(const QString& file);
+    bool save(const QString& file) const;
+
+    bool isEmpty() const;
+
+    const QHash<uint16_t, LightState>& lights() const;
+    void setLight(uint16_t destination, const LightState& state);
+    void clearLights();
+
+    const QList<QBluetoothDeviceInfo>& devices() const;
+    // replaces the record for the same device, devices are kept with their
+    // address, core configurations and last rssi so they can be connected to
+    // without waiting for an advert
+    void setDevice(const QBluetoothDeviceInfo& info);
+
+private:
+    QHash<uint16_t, LightState> mLights;
+    QList<QBluetoothDeviceInfo> mDevices;
+};
+
+inline bool StateSnapshot::isEmpty() const
+{
+    return mLights.isEmpty() && mDevices.isEmpty();
+}
+
+inline const QHash<uint16_t, LightState>& StateSnapshot::lights() const
+{
+    return mLights;
+}
+
+inline void StateSnapshot::setLight(uint16_t destination, const LightState& state)
+{
+    mLights[destination] = state;
+}
+
+inline void StateSnapshot::clearLights()
+{
+    mLights.clear();
+}
+
+inline const QList<QBluetoothDeviceInfo>& StateSnapshot::devices() const
+{
+    return mDevices;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <QtGlobal>
+#include <algorithm>
+#include <cstdint>
+
+// Paces packet bursts between a minimum safe gap and the configured device
+// delay. Confirmed bursts shrink the gap towards the floor, failed writes
+// double it, and while the smoothed loss ratio is high the gap is not
+// allowed to shrink. Without confirmations the gap stays where it is.
+// Times are metrics::now() nanoseconds, gaps are ms.
+class WritePacer
+{
+public:
+    WritePacer(uint32_t minGap, uint32_t maxGap);
+
+    uint32_t gap() const;
+    double loss() const;
+    // whether confirmations are still outstanding
+    bool isPending() const;
+    // ms until the next burst may go out
+    uint32_t remaining(qint64 now) const;
+
+    // a burst went out expecting this many confirmations, added to those
+    // still outstanding so the gap only shrinks once the links caught up
+    void started(qint64 now, uint32_t writes);
+    void completed();
+    void failed();
+
+private:
+    void succeeded();
+    void updateLoss(double sample);
+
+    uint32_t mMinGap, mMaxGap, mGap;
+    double mLoss = 0.;
+    qint64 mLastBurst = 0;
+    uint32_t mOutstanding = 0;
+    bool mStarted = false;
+};
+
+inline WritePacer::WritePacer(uint32_t minGap, uint32_t maxGap)
+    : mMinGap(std::min(minGap, maxGap)), mMaxGap(maxGap), mGap(maxGap)
+{
+}
+
+inline uint32_t WritePacer::gap() const
+{
+    return mGap;
+}
+
+inline double WritePacer::loss() const
+{
+    return mLoss;
+}
+
+inline bool WritePacer::isPending() const
+{
+    return mOutstanding > 0;
+}
+
+inline uint32_t WritePacer::remaining(qint64 now) const
+{
+    if (!mStarted) {
+        return 0;
+    }
+    const auto elapsed = (now - mLastBurst) / 1000000;
+    if (elapsed >= mGap) {
+        return 0;
+    }
+    return mGap - static_cast<uint32_t>(elapsed);
+}
+
+inline void WritePacer::started(qint64 now, uint32_t writes)
+{
+    mStarted = true;
+    mLastBurst = now;
+    mOutstanding += writes;
+}
+
+inline void WritePacer::completed()
+{
+    if (mOutstanding == 0) {
+        return;
+    }
+    if (--mOutstanding == 0) {
+        succeeded();
+    }
+}
+
+inline void WritePacer::failed()
+{
+    mOutstanding = 0;
+    updateLoss(1.);
+    mGap = std::min(mMaxGap, std::max(mGap * 2, mMinGap * 2));
+}
+
+inline void WritePacer::succeeded()
+{
+    mOutstanding = 0;
+    updateLoss(0.);
+    if (mLoss < 0.05) {
+        mGap = mMinGap + (mGap - mMinGap) * 3 / 4;
+    }
+}
+
+inline void WritePacer::updateLoss(double sample)
+{
+    mLoss += (sample - mLoss) / 8.;
+}
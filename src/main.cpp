@@ -5,7 +5,9 @@
 #include <signal.h>
 #include "Args.h"
 #include "HaloManager.h"
+#include "Metrics.h"
 #include "Options.h"
+#include <QBluetoothAddress>
 
 class QuitEvent : public QEvent
 {
@@ -16,10 +18,19 @@ public:
     }
 };
 
-class QuitEventFilter : public QObject
+class StatsEvent : public QEvent
 {
 public:
-    QuitEventFilter(HaloManager* manager, QObject* parent)
+    StatsEvent()
+        : QEvent(static_cast<QEvent::Type>(QEvent::User + 2))
+    {
+    }
+};
+
+class SignalEventFilter : public QObject
+{
+public:
+    SignalEventFilter(HaloManager* manager, QObject* parent)
         : QObject(parent), mManager(manager)
     {
     }
@@ -32,6 +43,10 @@ protected:
             mManager->quit();
             return true;
         }
+        if (ev->type() == QEvent::User + 2) {
+            metrics::logLatencies();
+            return true;
+        }
         return false;
     }
 
@@ -41,12 +56,17 @@ private:
 
 static void sigHandler(int sig)
 {
+    if (sig == SIGUSR1) {
+        QCoreApplication::postEvent(QCoreApplication::instance(), new StatsEvent());
+        return;
+    }
     QCoreApplication::postEvent(QCoreApplication::instance(), new QuitEvent());
 }
 
 int main(int argc, char** argv, char** envp)
 {
     signal(SIGINT, sigHandler);
+    signal(SIGUSR1, sigHandler);
 
     auto args = args::Parser::parse(argc, argv, envp, "HALO_", [](const char* msg, size_t offset, char* arg) {
         fprintf(stderr, "%s: %zu (%s)", msg, offset, arg);
@@ -58,6 +78,7 @@ int main(int argc, char** argv, char** envp)
     Options options;
     options.locations = args.value<QString>("locations");
     options.devices = args.value<QString>("devices");
+    options.stateDir = args.value<QString>("state-dir");
     options.mqttUser = args.value<QString>("mqtt-user");
     options.mqttPassword = args.value<QString>("mqtt-password");
     options.mqttHost = args.value<QString>("mqtt-host");
@@ -68,6 +89,13 @@ int main(int argc, char** argv, char** envp)
         fprintf(stderr, "Invalid --mqtt-port %d", mqttPort);
         exit(1);
     }
+    const auto mqttDebounce = args.value<int32_t>("mqtt-debounce", 50);
+    if (mqttDebounce >= 0) {
+        options.mqttDebounce = static_cast<uint32_t>(mqttDebounce);
+    } else {
+        fprintf(stderr, "Invalid --mqtt-debounce %d", mqttDebounce);
+        exit(1);
+    }
     const auto deviceDelay = args.value<int32_t>("device-delay", 1000);
     if (deviceDelay > 0) {
         options.deviceDelay = static_cast<uint32_t>(deviceDelay);
@@ -75,6 +103,100 @@ int main(int argc, char** argv, char** envp)
         fprintf(stderr, "Invalid --device-delay %d", deviceDelay);
         exit(1);
     }
+    // the floor the pacer may shrink the gap to on confirmed writes, no
+    // lower than --device-delay unless asked for. Below it, devices are
+    // written with response so the writes can be confirmed
+    const auto minDeviceDelay = args.value<int32_t>("min-device-delay", deviceDelay);
+    if (minDeviceDelay > 0 && minDeviceDelay <= deviceDelay) {
+        options.minDeviceDelay = static_cast<uint32_t>(minDeviceDelay);
+    } else {
+        fprintf(stderr, "Invalid --min-device-delay %d", minDeviceDelay);
+        exit(1);
+    }
+    const auto gateways = args.value<int32_t>("gateways", 0);
+    if (gateways >= 0) {
+        options.gateways = static_cast<uint32_t>(gateways);
+    } else {
+        fprintf(stderr, "Invalid --gateways %d", gateways);
+        exit(1);
+    }
+    const auto maxConnects = args.value<int32_t>("max-connects", 2);
+    if (maxConnects >= 0) {
+        options.maxConnects = static_cast<uint32_t>(maxConnects);
+    } else {
+        fprintf(stderr, "Invalid --max-connects %d", maxConnects);
+        exit(1);
+    }
+    // seconds, some stacks never give up on a peripheral that isn't there
+    const auto connectTimeout = args.value<int32_t>("connect-timeout", 20);
+    if (connectTimeout >= 0) {
+        options.connectTimeout = static_cast<uint32_t>(connectTimeout);
+    } else {
+        fprintf(stderr, "Invalid --connect-timeout %d", connectTimeout);
+        exit(1);
+    }
+    options.adapters = args.value<QString>("adapters");
+    if (!options.adapters.isEmpty()) {
+        for (const auto& adapter : options.adapters.split(',')) {
+            if (QBluetoothAddress(adapter.trimmed()).isNull()) {
+                fprintf(stderr, "Invalid --adapters %s", qPrintable(options.adapters));
+                exit(1);
+            }
+        }
+    }
+    options.lowLatencyInterval = args.value<double>("low-latency-interval", 7.5);
+    options.powerSavingInterval = args.value<double>("power-saving-interval", 100.);
+    if (options.lowLatencyInterval < 7.5 || options.powerSavingInterval > 1000. || options.lowLatencyInterval > options.powerSavingInterval) {
+        fprintf(stderr, "Invalid --low-latency-interval %f or --power-saving-interval %f", options.lowLatencyInterval, options.powerSavingInterval);
+        exit(1);
+    }
+    // off until the effect on command latency has been measured
+    options.connectionProfiles = args.value<bool>("connection-profiles", false);
+    const auto metricsPort = args.value<int32_t>("metrics-port", 0);
+    if (metricsPort >= 0 && metricsPort <= std::numeric_limits<uint16_t>::max()) {
+        options.metricsPort = static_cast<uint16_t>(metricsPort);
+    } else {
+        fprintf(stderr, "Invalid --metrics-port %d", metricsPort);
+        exit(1);
+    }
+    options.partialWrites = args.value<bool>("partial-writes", false);
+    const auto stateRefresh = args.value<int32_t>("state-refresh", 60);
+    if (stateRefresh >= 0) {
+        options.stateRefresh = static_cast<uint32_t>(stateRefresh);
+    } else {
+        fprintf(stderr, "Invalid --state-refresh %d", stateRefresh);
+        exit(1);
+    }
+    options.simulate = args.value<bool>("simulate", false);
+    const auto simulateConnectLatency = args.value<int32_t>("simulate-connect-latency", 500);
+    const auto simulateWriteLatency = args.value<int32_t>("simulate-write-latency", 20);
+    if (simulateConnectLatency >= 0 && simulateWriteLatency >= 0) {
+        options.simulateConnectLatency = static_cast<uint32_t>(simulateConnectLatency);
+        options.simulateWriteLatency = static_cast<uint32_t>(simulateWriteLatency);
+    } else {
+        fprintf(stderr, "Invalid --simulate-connect-latency %d or --simulate-write-latency %d", simulateConnectLatency, simulateWriteLatency);
+        exit(1);
+    }
+    options.simulateDropRate = args.value<double>("simulate-drop-rate", 0.);
+    options.simulateDisconnectRate = args.value<double>("simulate-disconnect-rate", 0.);
+    if (options.simulateDropRate < 0. || options.simulateDropRate > 1. || options.simulateDisconnectRate < 0. || options.simulateDisconnectRate > 1.) {
+        fprintf(stderr, "Invalid --simulate-drop-rate %f or --simulate-disconnect-rate %f", options.simulateDropRate, options.simulateDisconnectRate);
+        exit(1);
+    }
+    const auto simulateSwitchInterval = args.value<int32_t>("simulate-switch-interval", 0);
+    if (simulateSwitchInterval >= 0) {
+        options.simulateSwitchInterval = static_cast<uint32_t>(simulateSwitchInterval);
+    } else {
+        fprintf(stderr, "Invalid --simulate-switch-interval %d", simulateSwitchInterval);
+        exit(1);
+    }
+    const auto simulateAdverts = args.value<int32_t>("simulate-adverts", 0);
+    if (simulateAdverts >= 0) {
+        options.simulateAdverts = static_cast<uint32_t>(simulateAdverts);
+    } else {
+        fprintf(stderr, "Invalid --simulate-adverts %d", simulateAdverts);
+        exit(1);
+    }
 
     if (options.locations.isEmpty()) {
         fprintf(stderr, "No --locations\n");
@@ -88,7 +210,7 @@ int main(int argc, char** argv, char** envp)
     }
 
     HaloManager haloMqtt(std::move(options));
-    app.installEventFilter(new QuitEventFilter(&haloMqtt, &app));
+    app.installEventFilter(new SignalEventFilter(&haloMqtt, &app));
 
     return app.exec();
 }
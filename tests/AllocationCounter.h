@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstdint>
+
+// Counts every global operator new in the process, linked into the
+// benchmarks so they can report allocations next to the timings
+namespace allocations {
+
+uint64_t count();
+
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include "BluetoothTransport.h"
+#include <QByteArray>
+#include <QList>
+#include <QTimer>
+
+// A link that connects and resolves its service on the next event loop
+// turn, records every packet written to it and confirms each one. An
+// unknown mtu keeps HaloBluetooth from probing single writes, so exactly
+// the packets of a command end up in packets.
+class FakeLink : public BluetoothLink
+{
+public:
+    FakeLink(const QBluetoothDeviceInfo& info, QObject* parent);
+
+    void connectToDevice() override;
+    void discoverServices() override;
+    void write(Characteristic characteristic, const QByteArray& data) override;
+    bool confirmsWrites() const override;
+    int mtu() const override;
+    void requestConnectionUpdate(const QLowEnergyConnectionParameters& parameters) override;
+
+    // the mesh relaying a packet back, as the lights do for every command
+    void echo(const QByteArray& packet);
+
+    QList<QByteArray> packets;
+    int connects = 0;
+    // an absent peripheral, the connect never completes
+    bool unreachable = false;
+
+private:
+    QByteArray mLow;
+};
+
+// Creates FakeLinks and hands out adverts on request
+class FakeTransport : public BluetoothTransport
+{
+public:
+    FakeTransport(uint32_t maxConnects = 2, uint32_t connectTimeout = 0);
+
+    void initialize() override;
+    void startDiscovery() override;
+    void rediscover() override;
+    BluetoothLink* createLink(const QBluetoothDeviceInfo& info, QObject* parent) override;
+
+    // an Avi-on advert for the device
+    static QBluetoothDeviceInfo advert(const QBluetoothUuid& uuid);
+    void advertise(const QBluetoothDeviceInfo& info);
+
+    // every link created, owned by whoever asked for it
+    QList<FakeLink*> links;
+    // for the links created from now on
+    bool unreachable = false;
+};
+
+inline FakeLink::FakeLink(const QBluetoothDeviceInfo& info, QObject* parent)
+    : BluetoothLink(info, parent)
+{
+}
+
+inline void FakeLink::connectToDevice()
+{
+    ++connects;
+    if (unreachable) {
+        return;
+    }
+    QTimer::singleShot(0, this, [this]() {
+        emit connected();
+    });
+}
+
+inline void FakeLink::discoverServices()
+{
+    QTimer::singleShot(0, this, [this]() {
+        emit ready();
+    });
+}
+
+inline void FakeLink::write(Characteristic characteristic, const QByteArray& data)
+{
+    if (characteristic == Characteristic::Low) {
+        mLow = data;
+        return;
+    }
+    packets.append(mLow + data);
+    mLow.clear();
+    QTimer::singleShot(0, this, [this]() {
+        emit written();
+    });
+}
+
+inline bool FakeLink::confirmsWrites() const
+{
+    return true;
+}
+
+inline int FakeLink::mtu() const
+{
+    return -1;
+}
+
+inline void FakeLink::requestConnectionUpdate(const QLowEnergyConnectionParameters& parameters)
+{
+    Q_UNUSED(parameters);
+}
+
+inline void FakeLink::echo(const QByteArray& packet)
+{
+    emit packetReceived(packet);
+}
+
+inline FakeTransport::FakeTransport(uint32_t maxConnects, uint32_t connectTimeout)
+    : BluetoothTransport(maxConnects, connectTimeout)
+{
+}
+
+inline void FakeTransport::initialize()
+{
+    QTimer::singleShot(0, this, [this]() {
+        emit ready();
+    });
+}
+
+inline void FakeTransport::startDiscovery()
+{
+}
+
+inline void FakeTransport::rediscover()
+{
+}
+
+inline BluetoothLink* FakeTransport::createLink(const QBluetoothDeviceInfo& info, QObject* parent)
+{
+    auto link = new FakeLink(info, parent);
+    link->unreachable = unreachable;
+    links.append(link);
+    return link;
+}
+
+inline QBluetoothDeviceInfo FakeTransport::advert(const QBluetoothUuid& uuid)
+{
+    QBluetoothDeviceInfo info(uuid, QStringLiteral("Avi-on"), 0);
+    info.setCoreConfigurations(QBluetoothDeviceInfo::LowEnergyCoreConfiguration);
+    info.setRssi(-60);
+    return info;
+}
+
+inline void FakeTransport::advertise(const QBluetoothDeviceInfo& info)
+{
+    emit deviceDiscovered(info);
+}
@@ -0,0 +1,157 @@
+#include "AllocationCounter.h"
+#include "CommandParser.h"
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTest>
+#include <optional>
+
+// keeps the results from being optimized away
+static volatile uint32_t sink;
+
+static const QByteArray prefix = "halomqtt/light/command/halomqtt_";
+
+// What HaloMqtt did with a command before CommandParser: the topic as utf8,
+// the document, the lookups and the document again for the debug line
+static bool legacyParse(const QString& topicName, const QByteArray& payload, commands::Target* target, commands::Command* command)
+{
+    const auto doc = QJsonDocument::fromJson(payload);
+    if (!doc.isObject()) {
+        return false;
+    }
+    const auto topic = topicName.toUtf8();
+    if (!topic.startsWith(prefix)) {
+        return false;
+    }
+    const auto underscore = topic.indexOf('_', prefix.size());
+    if (underscore == -1) {
+        return false;
+    }
+    const QByteArrayView locationView(topic.constData() + prefix.size(), topic.constData() + underscore);
+    QByteArrayView deviceView(topic.constData() + underscore + 1, topic.constData() + topic.size());
+    target->isGroup = deviceView.startsWith('g');
+    if (target->isGroup) {
+        deviceView = deviceView.sliced(1);
+    }
+    bool ok;
+    target->locationId = static_cast<uint32_t>(locationView.toInt(&ok));
+    if (!ok) {
+        return false;
+    }
+    target->id = static_cast<uint32_t>(deviceView.toInt(&ok));
+    if (!ok) {
+        return false;
+    }
+
+    const auto object = doc.object();
+    *command = {};
+    if (object.contains("state")) {
+        command->state = object.value("state").toString() == "ON";
+    }
+    if (object.contains("brightness")) {
+        command->brightness = static_cast<uint8_t>(object.value("brightness").toInt());
+    }
+    if (object.contains("color_temp")) {
+        command->temperature = static_cast<uint32_t>(1000000.f / object.value("color_temp").toDouble());
+    }
+    sink = static_cast<uint32_t>(doc.toJson().size());
+    return true;
+}
+
+// A home assistant light command through the QJsonDocument path it used to
+// take and through CommandParser, timed and then run again counting
+// allocations per command
+class BenchCommandParser : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void qjsonDocument();
+    void qjsonDocumentAllocations();
+    void commandParser();
+    void commandParserAllocations();
+
+private:
+    static constexpr int AllocationRuns = 10000;
+
+    template<typename Func>
+    void reportAllocations(Func&& func);
+
+    QString mTopic;
+    QByteArray mPayload;
+};
+
+void BenchCommandParser::initTestCase()
+{
+    mTopic = QString::fromLatin1(prefix + "1_42");
+    mPayload = R"({"state":"ON","brightness":128,"color_temp":370,"transition":0.5})";
+    // the same command or the numbers mean nothing
+    commands::Target legacyTarget, target;
+    commands::Command legacyCommand, command;
+    QVERIFY(legacyParse(mTopic, mPayload, &legacyTarget, &legacyCommand));
+    QVERIFY(commands::parseTopic(mTopic, prefix, &target));
+    QVERIFY(commands::parsePayload(mPayload, &command));
+    QCOMPARE(target.locationId, legacyTarget.locationId);
+    QCOMPARE(target.id, legacyTarget.id);
+    QCOMPARE(command.state, legacyCommand.state);
+    QCOMPARE(command.brightness, legacyCommand.brightness);
+    QCOMPARE(command.temperature, legacyCommand.temperature);
+}
+
+template<typename Func>
+void BenchCommandParser::reportAllocations(Func&& func)
+{
+    const auto before = allocations::count();
+    for (int i = 0; i < AllocationRuns; ++i) {
+        func();
+    }
+    const auto perCommand = static_cast<qreal>(allocations::count() - before) / AllocationRuns;
+    qDebug() << "allocations per command" << perCommand;
+    QTest::setBenchmarkResult(perCommand, QTest::Events);
+}
+
+void BenchCommandParser::qjsonDocument()
+{
+    commands::Target target;
+    commands::Command command;
+    QBENCHMARK {
+        legacyParse(mTopic, mPayload, &target, &command);
+        sink = command.brightness.value_or(0);
+    }
+}
+
+void BenchCommandParser::qjsonDocumentAllocations()
+{
+    commands::Target target;
+    commands::Command command;
+    reportAllocations([&]() {
+        legacyParse(mTopic, mPayload, &target, &command);
+        sink = command.brightness.value_or(0);
+    });
+}
+
+void BenchCommandParser::commandParser()
+{
+    commands::Target target;
+    commands::Command command;
+    QBENCHMARK {
+        commands::parseTopic(mTopic, prefix, &target);
+        commands::parsePayload(mPayload, &command);
+        sink = command.brightness.value_or(0);
+    }
+}
+
+void BenchCommandParser::commandParserAllocations()
+{
+    commands::Target target;
+    commands::Command command;
+    reportAllocations([&]() {
+        commands::parseTopic(mTopic, prefix, &target);
+        commands::parsePayload(mPayload, &command);
+        sink = command.brightness.value_or(0);
+    });
+}
+
+QTEST_GUILESS_MAIN(BenchCommandParser)
+
+#include "bench_commandparser.moc"
@@ -0,0 +1,124 @@
+#include "AllocationCounter.h"
+#include "Crypto.h"
+#include "PacketBuilder.h"
+#include "Packets.h"
+#include <QTest>
+
+// keeps the results from being optimized away
+static volatile qsizetype sink;
+
+// makePacket, the original QAESEncryption and QMessageAuthenticationCode
+// path, against PacketEncoder and the keystream pool in PacketBuilder. Each
+// path is timed and then run again counting allocations per packet
+class BenchCrypto : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void makePacket();
+    void makePacketAllocations();
+    void encode();
+    void encodeAllocations();
+    void pooled();
+    void builderAllocations();
+
+private:
+    static constexpr int AllocationRuns = 10000;
+
+    template<typename Func>
+    void reportAllocations(Func&& func);
+
+    QByteArray mKey, mData;
+};
+
+void BenchCrypto::initTestCase()
+{
+    mKey = crypto::generateKey(QByteArray("halo-bench") + QByteArray::fromHex("004d4350"));
+    mData = packets::brightness(0x8081, 200);
+    // the same bytes or the numbers mean nothing
+    crypto::PacketEncoder encoder(mKey);
+    uint8_t out[crypto::PacketEncoder::MaxPacketSize];
+    const auto size = encoder.encode(1, mData, out);
+    QCOMPARE(QByteArray(reinterpret_cast<const char*>(out), size), crypto::makePacket(mKey, 1, mData));
+}
+
+template<typename Func>
+void BenchCrypto::reportAllocations(Func&& func)
+{
+    const auto before = allocations::count();
+    for (int i = 0; i < AllocationRuns; ++i) {
+        func(i);
+    }
+    const auto perPacket = static_cast<qreal>(allocations::count() - before) / AllocationRuns;
+    qDebug() << "allocations per packet" << perPacket;
+    QTest::setBenchmarkResult(perPacket, QTest::Events);
+}
+
+void BenchCrypto::makePacket()
+{
+    int32_t seq = 1;
+    QBENCHMARK {
+        sink = crypto::makePacket(mKey, seq++, mData).size();
+    }
+}
+
+void BenchCrypto::makePacketAllocations()
+{
+    reportAllocations([this](int seq) {
+        sink = crypto::makePacket(mKey, seq, mData).size();
+    });
+}
+
+void BenchCrypto::encode()
+{
+    crypto::PacketEncoder encoder(mKey);
+    uint8_t out[crypto::PacketEncoder::MaxPacketSize];
+    uint32_t seq = 1;
+    QBENCHMARK {
+        sink = encoder.encode(seq++, mData, out);
+    }
+}
+
+void BenchCrypto::encodeAllocations()
+{
+    crypto::PacketEncoder encoder(mKey);
+    uint8_t out[crypto::PacketEncoder::MaxPacketSize];
+    reportAllocations([&](int seq) {
+        sink = encoder.encode(static_cast<uint32_t>(seq), mData, out);
+    });
+}
+
+void BenchCrypto::pooled()
+{
+    // what makePacket costs once PacketBuilder has the keystream block
+    // precomputed, the xor, the hmac and the framing
+    crypto::PacketEncoder encoder(mKey);
+    uint8_t block[16];
+    encoder.keystream(1, block);
+    uint8_t out[crypto::PacketEncoder::MaxPacketSize];
+    uint32_t seq = 1;
+    QBENCHMARK {
+        sink = encoder.encode(seq++, block, mData, out);
+    }
+}
+
+void BenchCrypto::builderAllocations()
+{
+    uint32_t next = 1;
+    PacketBuilder builder(64);
+    builder.setKey(mKey);
+    builder.setSequenceFunction([&next]() { return next++; });
+    builder.refill();
+    uint8_t out[crypto::PacketEncoder::MaxPacketSize];
+    reportAllocations([&](int) {
+        if (builder.available() == 0) {
+            builder.refill();
+        }
+        sink = builder.makePacket(mData, out);
+    });
+}
+
+QTEST_GUILESS_MAIN(BenchCrypto)
+
+#include "bench_crypto.moc"
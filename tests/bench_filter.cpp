@@ -0,0 +1,152 @@
+#include "AdvertRouter.h"
+#include "AllocationCounter.h"
+#include "FakeTransport.h"
+#include "HaloBluetooth.h"
+#include <QElapsedTimer>
+#include <QTest>
+#include <memory>
+
+// The advert filter against a 500 device allowlist. 100k adverts are
+// replayed through the transport signal and AdvertRouter as HaloManager wires
+// them, one in twenty from a light in the location and the rest from the
+// neighbourhood's phones, tvs and watches
+class BenchFilter : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+    void filter();
+    void throughput();
+    void filterAllocations();
+
+private:
+    void replay();
+
+    static constexpr int ApprovedCount = 500;
+    static constexpr int OursCount = 5;
+    static constexpr int StrangerCount = 2000;
+    static constexpr int AdvertCount = 100000;
+
+    std::unique_ptr<FakeTransport> mTransport;
+    std::unique_ptr<HaloBluetooth> mBluetooth;
+    AdvertRouter mRouter;
+    QList<QBluetoothDeviceInfo> mAdverts;
+};
+
+static Options benchOptions()
+{
+    Options options;
+    options.mqttPort = 1883;
+    options.mqttDebounce = 0;
+    options.deviceDelay = 1000;
+    options.minDeviceDelay = 1000;
+    options.gateways = 0;
+    options.maxConnects = 2;
+    options.connectTimeout = 0;
+    options.lowLatencyInterval = 0.;
+    options.powerSavingInterval = 0.;
+    options.connectionProfiles = false;
+    options.partialWrites = false;
+    options.stateRefresh = 0;
+    options.metricsPort = 0;
+    options.simulate = false;
+    options.simulateConnectLatency = 0;
+    options.simulateWriteLatency = 0;
+    options.simulateDropRate = 0.;
+    options.simulateDisconnectRate = 0.;
+    options.simulateSwitchInterval = 0;
+    options.simulateAdverts = 0;
+    return options;
+}
+
+static QBluetoothDeviceInfo advert(const QBluetoothUuid& uuid, const QString& name)
+{
+    QBluetoothDeviceInfo info(uuid, name, 0);
+    info.setCoreConfigurations(QBluetoothDeviceInfo::LowEnergyCoreConfiguration);
+    info.setRssi(-70);
+    return info;
+}
+
+void BenchFilter::initTestCase()
+{
+    QList<QBluetoothUuid> approved;
+    approved.reserve(ApprovedCount);
+    for (int i = 0; i < ApprovedCount; ++i) {
+        approved.append(QBluetoothUuid(QUuid::createUuid()));
+    }
+    Location location;
+    location.id = 1;
+    location.passphrase = QStringLiteral("halo-bench");
+    for (int i = 0; i < ApprovedCount; ++i) {
+        location.devices.append({ static_cast<uint32_t>(i + 1), QString(), QString(), QString() });
+    }
+
+    QList<QBluetoothDeviceInfo> ours, strangers;
+    for (int i = 0; i < OursCount; ++i) {
+        ours.append(advert(approved[i * (ApprovedCount / OursCount)], QStringLiteral("Avi-on")));
+    }
+    for (int i = 0; i < StrangerCount; ++i) {
+        strangers.append(advert(QBluetoothUuid(QUuid::createUuid()), QStringLiteral("stranger")));
+    }
+    mAdverts.reserve(AdvertCount);
+    for (int i = 0; i < AdvertCount; ++i) {
+        mAdverts.append(i % 20 == 0 ? ours[(i / 20) % OursCount] : strangers[i % StrangerCount]);
+    }
+
+    mTransport = std::make_unique<FakeTransport>();
+    mBluetooth = std::make_unique<HaloBluetooth>(benchOptions(), mTransport.get(), std::move(location), QList<QBluetoothUuid>(approved), nullptr);
+    mRouter.addDevices(approved, mBluetooth.get());
+    QObject::connect(mTransport.get(), &BluetoothTransport::deviceDiscovered, this, [this](const QBluetoothDeviceInfo& info) {
+        mRouter.route(info);
+    });
+    // our lights get their links on the first pass, later adverts for them
+    // only find the device. The event loop doesn't run during the replays so
+    // the connects stay pending
+    replay();
+    QCOMPARE(mTransport->links.size(), qsizetype(OursCount));
+}
+
+void BenchFilter::cleanupTestCase()
+{
+    mBluetooth.reset();
+    mTransport.reset();
+}
+
+void BenchFilter::replay()
+{
+    for (const auto& info : std::as_const(mAdverts)) {
+        mTransport->advertise(info);
+    }
+}
+
+void BenchFilter::filter()
+{
+    QBENCHMARK {
+        replay();
+    }
+}
+
+void BenchFilter::throughput()
+{
+    QElapsedTimer timer;
+    timer.start();
+    replay();
+    const auto perMs = AdvertCount / std::max(static_cast<double>(timer.nsecsElapsed()) / 1e6, 1e-3);
+    qDebug() << "adverts per ms" << perMs;
+    QTest::setBenchmarkResult(perMs, QTest::Events);
+}
+
+void BenchFilter::filterAllocations()
+{
+    const auto before = allocations::count();
+    replay();
+    const auto perAdvert = static_cast<double>(allocations::count() - before) / AdvertCount;
+    qDebug() << "allocations per advert" << perAdvert;
+    QTest::setBenchmarkResult(perAdvert, QTest::Events);
+}
+
+QTEST_GUILESS_MAIN(BenchFilter)
+
+#include "bench_filter.moc"
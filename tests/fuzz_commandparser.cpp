@@ -0,0 +1,25 @@
+#include "CommandParser.h"
+#include <QString>
+#include <cstddef>
+#include <cstdint>
+
+// libFuzzer entry point, built with -DHALO_FUZZ=ON. The input is tried as a
+// command payload and, with the command prefix in front, as a topic:
+//   ./fuzz_commandparser -max_len=4096 corpus/
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    static const QByteArray prefix = "halomqtt/light/command/halomqtt_";
+    const QByteArrayView input(data, static_cast<qsizetype>(size));
+
+    commands::Command command;
+    if (commands::parsePayload(input, &command) && command.temperature.has_value()) {
+        // only ever a kelvin value from mireds in range
+        if (command.temperature.value() < 1 || command.temperature.value() > 1000000) {
+            __builtin_trap();
+        }
+    }
+
+    commands::Target target;
+    commands::parseTopic(QString::fromLatin1(prefix) + QString::fromUtf8(input), prefix, &target);
+    return 0;
+}
@@ -0,0 +1,360 @@
+#include "CommandParser.h"
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QRandomGenerator>
+#include <QTest>
+
+// The command topic and payload parser. Payloads come from whatever is on
+// the broker, so beyond the edge cases it is compared against the
+// QJsonDocument path it replaced on random well formed commands, and has to
+// survive random corruption of them
+class TestCommandParser : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void topic_data();
+    void topic();
+    void payload_data();
+    void payload();
+    void deepNesting();
+    void matchesQJsonDocument();
+    void mutationsAreSafe();
+
+private:
+    static constexpr int RandomRuns = 20000;
+};
+
+static const QByteArray prefix = "halomqtt/light/command/halomqtt_";
+
+// what HaloMqtt did before, minus the division by a zero color_temp
+static bool parseWithQJsonDocument(const QByteArray& payload, commands::Command* command)
+{
+    const auto doc = QJsonDocument::fromJson(payload);
+    if (!doc.isObject()) {
+        return false;
+    }
+    const auto object = doc.object();
+    *command = {};
+    if (object.contains("state")) {
+        command->state = object.value("state").toString() == "ON";
+    }
+    if (object.contains("brightness")) {
+        command->brightness = static_cast<uint8_t>(object.value("brightness").toInt());
+    }
+    if (object.contains("color_temp")) {
+        const auto mireds = object.value("color_temp");
+        if (mireds.isDouble() && mireds.toDouble() >= 1. && mireds.toDouble() <= 1000000.) {
+            command->temperature = static_cast<uint32_t>(1000000. / mireds.toDouble());
+        }
+    }
+    return true;
+}
+
+static void appendSpace(QByteArray& json, QRandomGenerator& random)
+{
+    static const char spaces[] = { ' ', '\t', '\n', '\r' };
+    while (random.bounded(4) == 0) {
+        json.append(spaces[random.bounded(4)]);
+    }
+}
+
+static void appendString(QByteArray& json, QRandomGenerator& random)
+{
+    static const char* escapes[] = { "\\\"", "\\\\", "\\n", "\\/", "\\u00e9" };
+    json.append('"');
+    const auto size = random.bounded(8);
+    for (int i = 0; i < size; ++i) {
+        if (random.bounded(6) == 0) {
+            json.append(escapes[random.bounded(5)]);
+        } else {
+            // printable, no quote or backslash
+            auto c = static_cast<char>(random.bounded(0x20, 0x7f));
+            json.append(c == '"' || c == '\\' ? 'x' : c);
+        }
+    }
+    json.append('"');
+}
+
+static void appendNumber(QByteArray& json, QRandomGenerator& random, int min, int max)
+{
+    json.append(QByteArray::number(random.bounded(min, max)));
+    if (random.bounded(4) == 0) {
+        json.append('.').append(QByteArray::number(random.bounded(10)));
+    }
+}
+
+// any json value, bounded well below the parser's nesting limit
+static void appendValue(QByteArray& json, QRandomGenerator& random, int depth = 0)
+{
+    appendSpace(json, random);
+    switch (random.bounded(depth < 3 ? 7 : 5)) {
+    case 0:
+        appendString(json, random);
+        break;
+    case 1:
+        appendNumber(json, random, -100000, 100000);
+        break;
+    case 2:
+        json.append(random.bounded(2) ? "true" : "false");
+        break;
+    case 3:
+        json.append("null");
+        break;
+    case 4:
+        json.append("\"ON\"");
+        break;
+    case 5: {
+        json.append('[');
+        const auto size = random.bounded(4);
+        for (int i = 0; i < size; ++i) {
+            if (i > 0) {
+                json.append(',');
+            }
+            appendValue(json, random, depth + 1);
+        }
+        appendSpace(json, random);
+        json.append(']');
+        break;
+    }
+    default: {
+        json.append('{');
+        const auto size = random.bounded(4);
+        for (int i = 0; i < size; ++i) {
+            if (i > 0) {
+                json.append(',');
+            }
+            appendSpace(json, random);
+            // the command keys nested are not the command's
+            json.append(i == 0 ? QByteArray("\"state\"") : "\"n" + QByteArray::number(i) + '"');
+            appendSpace(json, random);
+            json.append(':');
+            appendValue(json, random, depth + 1);
+        }
+        appendSpace(json, random);
+        json.append('}');
+        break;
+    }
+    }
+    appendSpace(json, random);
+}
+
+// a command object with some of the command keys, each once, and others
+static QByteArray randomCommand(QRandomGenerator& random)
+{
+    static const char* keys[] = { "state", "brightness", "color_temp", "transition", "effect", "color" };
+    QByteArray json;
+    appendSpace(json, random);
+    json.append('{');
+    bool first = true;
+    for (const auto key : keys) {
+        if (random.bounded(2) == 0) {
+            continue;
+        }
+        if (!first) {
+            json.append(',');
+        }
+        first = false;
+        appendSpace(json, random);
+        json.append('"').append(key).append('"');
+        appendSpace(json, random);
+        json.append(':');
+        const QByteArrayView name(key);
+        if (name == "state" && random.bounded(3) > 0) {
+            json.append(random.bounded(2) ? "\"ON\"" : "\"OFF\"");
+        } else if (name == "brightness" && random.bounded(3) > 0) {
+            appendNumber(json, random, -10, 400);
+        } else if (name == "color_temp" && random.bounded(3) > 0) {
+            appendNumber(json, random, -10, 1000);
+        } else {
+            appendValue(json, random);
+        }
+    }
+    appendSpace(json, random);
+    json.append('}');
+    appendSpace(json, random);
+    return json;
+}
+
+void TestCommandParser::topic_data()
+{
+    QTest::addColumn<QString>("topic");
+    QTest::addColumn<bool>("valid");
+    QTest::addColumn<uint>("locationId");
+    QTest::addColumn<uint>("id");
+    QTest::addColumn<bool>("isGroup");
+
+    QTest::newRow("device") << QString::fromLatin1(prefix + "1_42") << true << 1u << 42u << false;
+    QTest::newRow("group") << QString::fromLatin1(prefix + "7_g3") << true << 7u << 3u << true;
+    QTest::newRow("largest ids") << QString::fromLatin1(prefix + "4294967295_4294967295") << true << 4294967295u << 4294967295u << false;
+    QTest::newRow("location overflow") << QString::fromLatin1(prefix + "4294967296_1") << false << 0u << 0u << false;
+    QTest::newRow("id overflow") << QString::fromLatin1(prefix + "1_g99999999999") << false << 0u << 0u << false;
+    QTest::newRow("state topic") << QStringLiteral("halomqtt/light/state/halomqtt_1_2") << false << 0u << 0u << false;
+    QTest::newRow("prefix only") << QString::fromLatin1(prefix) << false << 0u << 0u << false;
+    QTest::newRow("short") << QStringLiteral("halomqtt/") << false << 0u << 0u << false;
+    QTest::newRow("empty") << QString() << false << 0u << 0u << false;
+    QTest::newRow("no underscore") << QString::fromLatin1(prefix + "12") << false << 0u << 0u << false;
+    QTest::newRow("no location") << QString::fromLatin1(prefix + "_2") << false << 0u << 0u << false;
+    QTest::newRow("no device") << QString::fromLatin1(prefix + "1_") << false << 0u << 0u << false;
+    QTest::newRow("group without id") << QString::fromLatin1(prefix + "1_g") << false << 0u << 0u << false;
+    QTest::newRow("trailing") << QString::fromLatin1(prefix + "1_2/set") << false << 0u << 0u << false;
+    QTest::newRow("negative") << QString::fromLatin1(prefix + "-1_2") << false << 0u << 0u << false;
+    QTest::newRow("other digits") << QString::fromLatin1(prefix) + QString::fromUtf8("١_2") << false << 0u << 0u << false;
+}
+
+void TestCommandParser::topic()
+{
+    QFETCH(QString, topic);
+    QFETCH(bool, valid);
+    QFETCH(uint, locationId);
+    QFETCH(uint, id);
+    QFETCH(bool, isGroup);
+
+    commands::Target target;
+    QCOMPARE(commands::parseTopic(topic, prefix, &target), valid);
+    if (valid) {
+        QCOMPARE(target.locationId, locationId);
+        QCOMPARE(target.id, id);
+        QCOMPARE(target.isGroup, isGroup);
+    }
+}
+
+void TestCommandParser::payload_data()
+{
+    // -1 for a field that isn't set
+    QTest::addColumn<QByteArray>("payload");
+    QTest::addColumn<bool>("valid");
+    QTest::addColumn<int>("state");
+    QTest::addColumn<int>("brightness");
+    QTest::addColumn<int>("temperature");
+
+    QTest::newRow("full") << QByteArray(R"({"state":"ON","brightness":128,"color_temp":370})") << true << 1 << 128 << 2702;
+    QTest::newRow("off") << QByteArray(R"({"state":"OFF"})") << true << 0 << -1 << -1;
+    QTest::newRow("lower case on") << QByteArray(R"({"state":"on"})") << true << 0 << -1 << -1;
+    QTest::newRow("state not a string") << QByteArray(R"({"state":true})") << true << 0 << -1 << -1;
+    QTest::newRow("brightness fraction") << QByteArray(R"({"brightness":12.5})") << true << -1 << 0 << -1;
+    QTest::newRow("brightness string") << QByteArray(R"({"brightness":"12"})") << true << -1 << 0 << -1;
+    QTest::newRow("brightness wraps") << QByteArray(R"({"brightness":300})") << true << -1 << 44 << -1;
+    QTest::newRow("brightness exponent") << QByteArray(R"({"brightness":1e2})") << true << -1 << 100 << -1;
+    QTest::newRow("color_temp zero") << QByteArray(R"({"color_temp":0})") << true << -1 << -1 << -1;
+    QTest::newRow("color_temp negative") << QByteArray(R"({"color_temp":-5})") << true << -1 << -1 << -1;
+    QTest::newRow("color_temp string") << QByteArray(R"({"color_temp":"370"})") << true << -1 << -1 << -1;
+    QTest::newRow("whitespace") << QByteArray(" \n{ \"state\" :\t\"ON\" }\r\n") << true << 1 << -1 << -1;
+    QTest::newRow("empty object") << QByteArray("{}") << true << -1 << -1 << -1;
+    QTest::newRow("unknown keys")
+        << QByteArray(R"({"effect":"x","transition":2,"color":{"r":1,"g":2,"b":[3,{}]},"flag":null,"state":"ON"})") << true << 1 << -1 << -1;
+    QTest::newRow("escaped quote") << QByteArray(R"({"effect":"a\"b","state":"ON"})") << true << 1 << -1 << -1;
+
+    QTest::newRow("empty") << QByteArray() << false << -1 << -1 << -1;
+    QTest::newRow("space") << QByteArray("  ") << false << -1 << -1 << -1;
+    QTest::newRow("array") << QByteArray(R"([{"state":"ON"}])") << false << -1 << -1 << -1;
+    QTest::newRow("string") << QByteArray(R"("ON")") << false << -1 << -1 << -1;
+    QTest::newRow("null") << QByteArray("null") << false << -1 << -1 << -1;
+    QTest::newRow("unterminated") << QByteArray(R"({"state":"ON")") << false << -1 << -1 << -1;
+    QTest::newRow("unterminated string") << QByteArray(R"({"state":"ON)") << false << -1 << -1 << -1;
+    QTest::newRow("escape at end") << QByteArray(R"({"effect":"a\)") << false << -1 << -1 << -1;
+    QTest::newRow("extra brace") << QByteArray(R"({"state":"ON"}})") << false << -1 << -1 << -1;
+    QTest::newRow("trailing garbage") << QByteArray(R"({"state":"ON"} x)") << false << -1 << -1 << -1;
+    QTest::newRow("two objects") << QByteArray(R"({}{})") << false << -1 << -1 << -1;
+    QTest::newRow("missing colon") << QByteArray(R"({"state" "ON"})") << false << -1 << -1 << -1;
+    QTest::newRow("trailing comma") << QByteArray(R"({"state":"ON",})") << false << -1 << -1 << -1;
+    QTest::newRow("only comma") << QByteArray("{,}") << false << -1 << -1 << -1;
+    QTest::newRow("bare word") << QByteArray(R"({"state":ON})") << false << -1 << -1 << -1;
+    QTest::newRow("missing value") << QByteArray(R"({"brightness":})") << false << -1 << -1 << -1;
+    QTest::newRow("bad literal") << QByteArray(R"({"a":tru})") << false << -1 << -1 << -1;
+    QTest::newRow("unquoted key") << QByteArray(R"({state:"ON"})") << false << -1 << -1 << -1;
+    QTest::newRow("control character") << QByteArray("{\"a\":\"\x01\"}") << false << -1 << -1 << -1;
+    QTest::newRow("array trailing comma") << QByteArray(R"({"a":[1,]})") << false << -1 << -1 << -1;
+    QTest::newRow("unterminated array") << QByteArray(R"({"a":[1,2})") << false << -1 << -1 << -1;
+}
+
+void TestCommandParser::payload()
+{
+    QFETCH(QByteArray, payload);
+    QFETCH(bool, valid);
+    QFETCH(int, state);
+    QFETCH(int, brightness);
+    QFETCH(int, temperature);
+
+    commands::Command command;
+    QCOMPARE(commands::parsePayload(payload, &command), valid);
+    if (!valid) {
+        return;
+    }
+    QCOMPARE(command.state, state < 0 ? std::optional<bool>() : std::optional<bool>(state == 1));
+    QCOMPARE(command.brightness, brightness < 0 ? std::optional<uint8_t>() : std::optional<uint8_t>(brightness));
+    QCOMPARE(command.temperature, temperature < 0 ? std::optional<uint32_t>() : std::optional<uint32_t>(temperature));
+}
+
+void TestCommandParser::deepNesting()
+{
+    // rejected without recursing through all of it
+    const auto payload = "{\"a\":" + QByteArray(100000, '[');
+    commands::Command command;
+    QVERIFY(!commands::parsePayload(payload, &command));
+
+    // a little nesting is fine
+    QVERIFY(commands::parsePayload(R"({"a":[[[{"b":[[]]}]]],"state":"ON"})", &command));
+    QCOMPARE(command.state, std::optional<bool>(true));
+}
+
+void TestCommandParser::matchesQJsonDocument()
+{
+    QRandomGenerator random(0x48414c4f);
+    for (int run = 0; run < RandomRuns; ++run) {
+        const auto json = randomCommand(random);
+        // the whole command and, now and then, every way of cutting it short
+        const auto cuts = run % 50 == 0 ? json.size() : 1;
+        for (qsizetype cut = 0; cut < cuts; ++cut) {
+            const auto payload = json.first(json.size() - cut);
+            commands::Command command, expected;
+            const bool valid = commands::parsePayload(payload, &command);
+            QVERIFY2(valid == parseWithQJsonDocument(payload, &expected), payload.constData());
+            if (valid) {
+                QVERIFY2(command.state == expected.state, payload.constData());
+                QVERIFY2(command.brightness == expected.brightness, payload.constData());
+                QVERIFY2(command.temperature == expected.temperature, payload.constData());
+            }
+        }
+    }
+}
+
+void TestCommandParser::mutationsAreSafe()
+{
+    // only has to return, run it under -fsanitize=address to catch reads
+    // past the payload, fuzz_commandparser goes further
+    QRandomGenerator random(0x6d757461);
+    commands::Command command;
+    commands::Target target;
+    for (int run = 0; run < RandomRuns; ++run) {
+        auto payload = randomCommand(random);
+        auto topic = prefix + QByteArray::number(random.bounded(100)) + "_g" + QByteArray::number(random.bounded(100));
+        const auto mutations = random.bounded(1, 5);
+        for (int i = 0; i < mutations; ++i) {
+            auto& data = random.bounded(4) == 0 ? topic : payload;
+            const auto pos = data.isEmpty() ? 0 : random.bounded(static_cast<int>(data.size()));
+            switch (random.bounded(4)) {
+            case 0:
+                if (!data.isEmpty()) {
+                    data[pos] = static_cast<char>(random.bounded(256));
+                }
+                break;
+            case 1:
+                data.insert(pos, static_cast<char>(random.bounded(256)));
+                break;
+            case 2:
+                data.remove(pos, 1);
+                break;
+            default:
+                data.truncate(pos);
+                break;
+            }
+        }
+        commands::parsePayload(payload, &command);
+        commands::parseTopic(QString::fromUtf8(topic), prefix, &target);
+    }
+}
+
+QTEST_GUILESS_MAIN(TestCommandParser)
+
+#include "tst_commandparser.moc"
@@ -0,0 +1,84 @@
+#include "FakeTransport.h"
+#include <QSignalSpy>
+#include <QTest>
+#include <memory>
+
+// The transport's connect slots per adapter and the connect timeout
+class TestConnections : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void limitPerAdapter();
+    void priorityOrder();
+    void timeoutFreesSlot();
+
+private:
+    static FakeLink* createLink(FakeTransport& transport, QObject* parent, int adapter = 0);
+};
+
+FakeLink* TestConnections::createLink(FakeTransport& transport, QObject* parent, int adapter)
+{
+    auto link = static_cast<FakeLink*>(transport.createLink(FakeTransport::advert(QBluetoothUuid(QUuid::createUuid())), parent));
+    link->setAdapter(adapter);
+    return link;
+}
+
+void TestConnections::limitPerAdapter()
+{
+    FakeTransport transport(1);
+    transport.unreachable = true;
+    QObject owner;
+    auto first = createLink(transport, &owner, 0);
+    auto second = createLink(transport, &owner, 0);
+    auto other = createLink(transport, &owner, 1);
+    transport.requestConnect(first, 0);
+    transport.requestConnect(second, 0);
+    transport.requestConnect(other, 0);
+    // one at a time on each adapter
+    QCOMPARE(first->connects, 1);
+    QCOMPARE(second->connects, 0);
+    QCOMPARE(other->connects, 1);
+
+    delete first;
+    QCOMPARE(second->connects, 1);
+}
+
+void TestConnections::priorityOrder()
+{
+    FakeTransport transport(1);
+    QObject owner;
+    auto busy = createLink(transport, &owner);
+    auto low = createLink(transport, &owner);
+    auto high = createLink(transport, &owner);
+    busy->unreachable = true;
+    transport.requestConnect(busy, 0);
+    transport.requestConnect(low, -80);
+    transport.requestConnect(high, 2000);
+
+    emit busy->errorOccurred(QLowEnergyController::ConnectionError);
+    QCOMPARE(high->connects, 1);
+    QCOMPARE(low->connects, 0);
+    // low goes once high has connected
+    QTRY_COMPARE(low->connects, 1);
+}
+
+void TestConnections::timeoutFreesSlot()
+{
+    FakeTransport transport(1, 1);
+    transport.unreachable = true;
+    QObject owner;
+    auto absent = createLink(transport, &owner);
+    auto next = createLink(transport, &owner);
+    QSignalSpy failed(absent, &BluetoothLink::errorOccurred);
+    transport.requestConnect(absent, 0);
+    transport.requestConnect(next, 0);
+    QCOMPARE(next->connects, 0);
+
+    QTRY_COMPARE_WITH_TIMEOUT(failed.count(), qsizetype(1), 3000);
+    QCOMPARE(next->connects, 1);
+}
+
+QTEST_GUILESS_MAIN(TestConnections)
+
+#include "tst_connections.moc"
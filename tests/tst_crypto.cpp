@@ -0,0 +1,125 @@
+#include "Crypto.h"
+#include "PacketBuilder.h"
+#include "Packets.h"
+#include <QTest>
+#include <cstring>
+
+// PacketEncoder and PacketBuilder have to produce exactly the bytes of the
+// original makePacket, the lights reject anything else
+class TestCrypto : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void knownAnswer();
+    void matchesMakePacket_data();
+    void matchesMakePacket();
+    void builderMatchesMakePacket();
+    void decodeRoundTrip();
+    void decodeRejectsTampering();
+
+private:
+    QByteArray mKey;
+};
+
+void TestCrypto::initTestCase()
+{
+    mKey = crypto::generateKey(QByteArray("halo-test") + QByteArray::fromHex("004d4350"));
+}
+
+void TestCrypto::knownAnswer()
+{
+    // computed with openssl aes-128-ofb and python's hmac
+    QCOMPARE(mKey.toHex(), QByteArray("340ef1db71ddc51a523e6f776ba45401"));
+    const auto expected = QByteArray::fromHex("5634120080c178ef72260d5fe39edf97969912b6d17d6c36619bd59a79ff");
+    const auto data = packets::brightness(0x8081, 200);
+    QCOMPARE(crypto::makePacket(mKey, 0x123456, data), expected);
+
+    crypto::PacketEncoder encoder(mKey);
+    uint8_t out[crypto::PacketEncoder::MaxPacketSize];
+    const auto size = encoder.encode(0x123456, data, out);
+    QCOMPARE(QByteArray(reinterpret_cast<const char*>(out), size), expected);
+}
+
+void TestCrypto::matchesMakePacket_data()
+{
+    QTest::addColumn<QByteArray>("data");
+    QTest::addColumn<int>("seq");
+
+    QTest::newRow("brightness") << packets::brightness(0x8081, 128) << 1;
+    QTest::newRow("temperature") << packets::temperature(0x8080, 2700) << 0xabcdef;
+    QTest::newRow("group") << packets::brightness(0, 0) << 0xffffff;
+    QTest::newRow("one byte") << QByteArray(1, '\x42') << 4242;
+    QTest::newRow("one block") << QByteArray(16, '\x11') << 77;
+    QTest::newRow("two blocks") << QByteArray(20, '\x22') << 78;
+    QTest::newRow("max") << QByteArray(crypto::PacketEncoder::MaxDataSize, '\x33') << 79;
+}
+
+void TestCrypto::matchesMakePacket()
+{
+    QFETCH(QByteArray, data);
+    QFETCH(int, seq);
+
+    crypto::PacketEncoder encoder(mKey);
+    uint8_t out[crypto::PacketEncoder::MaxPacketSize];
+    const auto size = encoder.encode(static_cast<uint32_t>(seq), data, out);
+    QVERIFY(size > 0);
+    QCOMPARE(QByteArray(reinterpret_cast<const char*>(out), size), crypto::makePacket(mKey, seq, data));
+}
+
+void TestCrypto::builderMatchesMakePacket()
+{
+    uint32_t next = 1000;
+    PacketBuilder builder(8);
+    builder.setKey(mKey);
+    builder.setSequenceFunction([&next]() { return next++; });
+    builder.refill();
+
+    // from the precomputed pool and past it
+    const auto data = packets::brightness(0x8082, 64);
+    for (int32_t seq = 1000; seq < 1020; ++seq) {
+        QCOMPARE(builder.makePacket(data), crypto::makePacket(mKey, seq, data));
+    }
+}
+
+void TestCrypto::decodeRoundTrip()
+{
+    crypto::PacketEncoder encoder(mKey);
+    const auto data = packets::temperature(0x8085, 4000);
+    uint8_t packet[crypto::PacketEncoder::MaxPacketSize];
+    const auto size = encoder.encode(0x10203, data, packet);
+
+    uint8_t payload[crypto::PacketEncoder::MaxDataSize];
+    uint32_t seq = 0;
+    uint16_t source = 0;
+    const auto payloadSize = encoder.decode(QByteArrayView(packet, size), payload, &seq, &source);
+    QCOMPARE(payloadSize, qsizetype(16));
+    QCOMPARE(seq, 0x10203u);
+    QCOMPARE(source, uint16_t(0x8000));
+    QCOMPARE(QByteArray(reinterpret_cast<const char*>(payload), data.size()), data);
+}
+
+void TestCrypto::decodeRejectsTampering()
+{
+    crypto::PacketEncoder encoder(mKey);
+    uint8_t packet[crypto::PacketEncoder::MaxPacketSize];
+    const auto size = encoder.encode(55, packets::brightness(0x8081, 1), packet);
+    uint8_t payload[crypto::PacketEncoder::MaxDataSize];
+
+    for (qsizetype i = 0; i < size - 1; ++i) {
+        uint8_t tampered[crypto::PacketEncoder::MaxPacketSize];
+        memcpy(tampered, packet, size);
+        tampered[i] ^= 0x01;
+        QCOMPARE(encoder.decode(QByteArrayView(tampered, size), payload), qsizetype(-1));
+    }
+    // another location's key
+    crypto::PacketEncoder other(crypto::generateKey(QByteArray("other") + QByteArray::fromHex("004d4350")));
+    QCOMPARE(other.decode(QByteArrayView(packet, size), payload), qsizetype(-1));
+    // truncated
+    QCOMPARE(encoder.decode(QByteArrayView(packet, 13), payload), qsizetype(-1));
+}
+
+QTEST_GUILESS_MAIN(TestCrypto)
+
+#include "tst_crypto.moc"
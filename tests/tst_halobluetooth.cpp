@@ -0,0 +1,197 @@
+#include "Crypto.h"
+#include "FakeTransport.h"
+#include "HaloBluetooth.h"
+#include "Packets.h"
+#include <QSignalSpy>
+#include <QTest>
+#include <memory>
+
+// The exact mesh packets setState() puts on air for each command shape, one
+// packet per attribute and none for a state the mesh already confirmed
+class TestHaloBluetooth : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void init();
+    void cleanup();
+    void brightnessOnly();
+    void temperatureOnly();
+    void brightnessAndTemperature();
+    void suppressedOnceConfirmed();
+    void notSuppressedUntilConfirmed();
+    void approvedByAddress();
+
+private:
+    // the decoded commands written since the last call
+    QList<LightState> takeWritten(uint16_t* destination = nullptr);
+
+    static constexpr uint16_t light = 0x8081;
+
+    QByteArray mKey;
+    std::unique_ptr<FakeTransport> mTransport;
+    std::unique_ptr<HaloBluetooth> mBluetooth;
+    FakeLink* mLink = nullptr;
+};
+
+static Options testOptions()
+{
+    Options options;
+    options.mqttPort = 1883;
+    options.mqttDebounce = 0;
+    // the pacer never holds anything back for long
+    options.deviceDelay = 1;
+    options.minDeviceDelay = 1;
+    options.gateways = 0;
+    options.maxConnects = 2;
+    options.connectTimeout = 0;
+    options.lowLatencyInterval = 0.;
+    options.powerSavingInterval = 0.;
+    options.connectionProfiles = false;
+    options.partialWrites = false;
+    options.stateRefresh = 60;
+    options.metricsPort = 0;
+    options.simulate = false;
+    options.simulateConnectLatency = 0;
+    options.simulateWriteLatency = 0;
+    options.simulateDropRate = 0.;
+    options.simulateDisconnectRate = 0.;
+    options.simulateSwitchInterval = 0;
+    options.simulateAdverts = 0;
+    return options;
+}
+
+void TestHaloBluetooth::init()
+{
+    const QBluetoothUuid uuid(QUuid::fromString("8a4e0f1c-2d3b-4c5a-9e6f-7a8b9c0d1e2f"));
+    Location location;
+    location.id = 1;
+    location.passphrase = QStringLiteral("halo-test");
+    location.devices.append({ 1, QStringLiteral("00:11:22:33:44:55"), QStringLiteral("light"), QString() });
+    mKey = crypto::generateKey(location.passphrase.toUtf8() + QByteArray::fromHex("004d4350"));
+
+    mTransport = std::make_unique<FakeTransport>();
+    mBluetooth = std::make_unique<HaloBluetooth>(testOptions(), mTransport.get(), std::move(location), QList<QBluetoothUuid> { uuid }, nullptr);
+    QSignalSpy ready(mBluetooth.get(), &HaloBluetooth::devicesReady);
+    mBluetooth->deviceDiscovered(FakeTransport::advert(uuid));
+    QTRY_COMPARE(ready.count(), qsizetype(1));
+    QCOMPARE(mTransport->links.size(), qsizetype(1));
+    mLink = mTransport->links.first();
+}
+
+void TestHaloBluetooth::cleanup()
+{
+    mBluetooth.reset();
+    mTransport.reset();
+    mLink = nullptr;
+}
+
+QList<LightState> TestHaloBluetooth::takeWritten(uint16_t* destination)
+{
+    crypto::PacketEncoder decoder(mKey);
+    QList<LightState> states;
+    for (const auto& packet : std::as_const(mLink->packets)) {
+        uint8_t payload[crypto::PacketEncoder::MaxDataSize];
+        const auto size = decoder.decode(packet, payload);
+        LightState state;
+        if (size < 0 || !packets::parse(QByteArrayView(payload, size), destination, &state)) {
+            qWarning() << "unexpected packet" << packet.toHex();
+            continue;
+        }
+        states.append(state);
+    }
+    mLink->packets.clear();
+    return states;
+}
+
+void TestHaloBluetooth::brightnessOnly()
+{
+    mBluetooth->setState(light, { 200, {} });
+    QTRY_COMPARE(mLink->packets.size(), qsizetype(1));
+
+    uint16_t destination = 0;
+    const auto written = takeWritten(&destination);
+    QCOMPARE(destination, light);
+    QCOMPARE(written.size(), qsizetype(1));
+    QCOMPARE(written[0].brightness, std::optional<uint8_t>(200));
+    QVERIFY(!written[0].temperature.has_value());
+}
+
+void TestHaloBluetooth::temperatureOnly()
+{
+    mBluetooth->setState(light, { {}, 3000 });
+    QTRY_COMPARE(mLink->packets.size(), qsizetype(1));
+
+    const auto written = takeWritten();
+    QCOMPARE(written.size(), qsizetype(1));
+    QVERIFY(!written[0].brightness.has_value());
+    QCOMPARE(written[0].temperature, std::optional<uint16_t>(3000));
+}
+
+void TestHaloBluetooth::brightnessAndTemperature()
+{
+    mBluetooth->setState(light, { 128, 4000 });
+    QTRY_COMPARE(mLink->packets.size(), qsizetype(2));
+
+    const auto written = takeWritten();
+    QCOMPARE(written.size(), qsizetype(2));
+    QCOMPARE(written[0].brightness, std::optional<uint8_t>(128));
+    QCOMPARE(written[1].temperature, std::optional<uint16_t>(4000));
+    // and nothing after the burst
+    QTest::qWait(50);
+    QCOMPARE(mLink->packets.size(), qsizetype(0));
+}
+
+void TestHaloBluetooth::suppressedOnceConfirmed()
+{
+    mBluetooth->setState(light, { 100, 2700 });
+    QTRY_COMPARE(mLink->packets.size(), qsizetype(2));
+    const auto sent = mLink->packets;
+    mLink->packets.clear();
+    for (const auto& packet : sent) {
+        mLink->echo(packet);
+    }
+
+    mBluetooth->setState(light, { 100, 2700 });
+    QTest::qWait(50);
+    QCOMPARE(mLink->packets.size(), qsizetype(0));
+
+    // only the attribute that changed goes out
+    mBluetooth->setState(light, { 100, 5000 });
+    QTRY_COMPARE(mLink->packets.size(), qsizetype(1));
+    const auto written = takeWritten();
+    QCOMPARE(written.size(), qsizetype(1));
+    QCOMPARE(written[0].temperature, std::optional<uint16_t>(5000));
+}
+
+void TestHaloBluetooth::notSuppressedUntilConfirmed()
+{
+    // a lost packet must not swallow the retry
+    mBluetooth->setState(light, { 50, {} });
+    QTRY_COMPARE(mLink->packets.size(), qsizetype(1));
+    mLink->packets.clear();
+
+    mBluetooth->setState(light, { 50, {} });
+    QTRY_COMPARE(mLink->packets.size(), qsizetype(1));
+}
+
+void TestHaloBluetooth::approvedByAddress()
+{
+    // BlueZ reports no device uuid, only the address
+    const QBluetoothAddress address(QStringLiteral("c4:ac:05:42:7e:01"));
+    QBluetoothDeviceInfo info(address, QStringLiteral("Avi-on"), 0);
+    info.setCoreConfigurations(QBluetoothDeviceInfo::LowEnergyCoreConfiguration);
+    QVERIFY(info.deviceUuid().isNull());
+    QCOMPARE(deviceId(info), deviceId(address));
+    QVERIFY(deviceId(address) != deviceId(QBluetoothAddress(QStringLiteral("c4:ac:05:42:7e:02"))));
+
+    FakeTransport transport;
+    HaloBluetooth bluetooth(testOptions(), &transport, Location(), QList<QBluetoothUuid> { deviceId(address) }, nullptr);
+    bluetooth.deviceDiscovered(info);
+    QTRY_COMPARE(transport.links.size(), qsizetype(1));
+    QCOMPARE(transport.links.first()->info().address(), address);
+}
+
+QTEST_GUILESS_MAIN(TestHaloBluetooth)
+
+#include "tst_halobluetooth.moc"